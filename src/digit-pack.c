@@ -0,0 +1,418 @@
+/*
+** Packed, random-access storage for pi digits, see digit-pack.h for the
+** file layout.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "digit-pack.h"
+
+#define FNV_OFFSET          0xcbf29ce484222325ULL
+#define FNV_PRIME           0x00000100000001b3ULL
+
+struct _pack_writer {
+    FILE *          fptr;
+    uint64_t *      block;
+    uint64_t        num_words;
+    uint64_t        word;
+    int             word_digits;
+    uint64_t        num_digits;
+    uint64_t        offset;
+    pack_index_t *  index;
+    uint64_t        num_blocks;
+    uint64_t        max_blocks;
+};
+
+struct _pack_reader {
+    int             fd;
+    size_t          length;
+    const uint8_t * base;
+    pack_header_t   header;
+    pack_index_t *  index;
+    uint64_t        verified_block;
+};
+
+static const uint64_t pow10_table[PACK_DIGITS_PER_WORD + 1] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+/*
+** FNV-1a taken a 64-bit word at a time, good enough to catch
+** corruption and much cheaper than a byte-wise hash over GBs.
+*/
+static uint64_t checksum_words(const uint64_t * words, uint64_t n) {
+    uint64_t        h = FNV_OFFSET;
+    uint64_t        i;
+
+    for (i = 0; i < n; i++) {
+        h ^= words[i];
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+static uint64_t checksum_header(const pack_header_t * h) {
+    uint64_t        words[offsetof(pack_header_t, checksum) / sizeof(uint64_t)];
+
+    memcpy(words, h, sizeof(words));
+
+    return checksum_words(words, sizeof(words) / sizeof(uint64_t));
+}
+
+static int writer_flush_block(pack_writer_t * w) {
+    if (w->num_words == 0) {
+        return 0;
+    }
+
+    if (w->num_blocks == w->max_blocks) {
+        pack_index_t *  index;
+
+        w->max_blocks = w->max_blocks ? w->max_blocks * 2 : 64;
+        index = realloc(w->index, sizeof(pack_index_t) * w->max_blocks);
+
+        if (index == NULL) {
+            fprintf(stderr, "Could not allocate block index: %s\n", strerror(errno));
+            return -1;
+        }
+
+        w->index = index;
+    }
+
+    w->index[w->num_blocks].offset = w->offset;
+    w->index[w->num_blocks].checksum = checksum_words(w->block, w->num_words);
+    w->num_blocks++;
+
+    if (fwrite(w->block, sizeof(uint64_t), w->num_words, w->fptr) != w->num_words) {
+        fprintf(stderr, "Could not write packed block: %s\n", strerror(errno));
+        return -1;
+    }
+
+    w->offset += w->num_words * sizeof(uint64_t);
+    w->num_words = 0;
+
+    return 0;
+}
+
+static int writer_put_word(pack_writer_t * w) {
+    w->block[w->num_words++] = w->word;
+    w->word = 0;
+    w->word_digits = 0;
+
+    if (w->num_words == PACK_WORDS_PER_BLOCK) {
+        return writer_flush_block(w);
+    }
+
+    return 0;
+}
+
+pack_writer_t * pack_writer_open(const char * pszFilename) {
+    pack_writer_t *     w;
+    pack_header_t       header;
+
+    w = calloc(1, sizeof(pack_writer_t));
+
+    if (w == NULL) {
+        return NULL;
+    }
+
+    w->block = malloc(sizeof(uint64_t) * PACK_WORDS_PER_BLOCK);
+
+    if (w->block == NULL) {
+        free(w);
+        return NULL;
+    }
+
+    w->fptr = fopen(pszFilename, "wb");
+
+    if (w->fptr == NULL) {
+        fprintf(stderr, "Could not open packed file '%s': %s\n", pszFilename, strerror(errno));
+        free(w->block);
+        free(w);
+        return NULL;
+    }
+
+    /*
+    ** Reserve space for the header, it is filled in once
+    ** we know how many digits & blocks there are...
+    */
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, w->fptr);
+
+    w->offset = sizeof(header);
+
+    return w;
+}
+
+int pack_writer_put(pack_writer_t * w, const char * digits, size_t n) {
+    size_t          i;
+
+    for (i = 0; i < n; i++) {
+        if (digits[i] < '0' || digits[i] > '9') {
+            fprintf(stderr, "Invalid digit '%c' in packed output\n", digits[i]);
+            return -1;
+        }
+
+        w->word = (w->word * 10) + (uint64_t)(digits[i] - '0');
+        w->word_digits++;
+        w->num_digits++;
+
+        if (w->word_digits == PACK_DIGITS_PER_WORD) {
+            if (writer_put_word(w)) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int pack_writer_close(pack_writer_t * w) {
+    pack_header_t       header;
+    int                 error = 0;
+
+    if (w->word_digits > 0) {
+        w->word *= pow10_table[PACK_DIGITS_PER_WORD - w->word_digits];
+        error = writer_put_word(w);
+    }
+
+    if (!error) {
+        error = writer_flush_block(w);
+    }
+
+    if (!error && w->num_blocks > 0) {
+        if (fwrite(w->index, sizeof(pack_index_t), w->num_blocks, w->fptr) != w->num_blocks) {
+            fprintf(stderr, "Could not write block index: %s\n", strerror(errno));
+            error = -1;
+        }
+    }
+
+    if (!error) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+
+        header.version = PACK_VERSION;
+        header.digits_per_word = PACK_DIGITS_PER_WORD;
+        header.num_digits = w->num_digits;
+        header.words_per_block = PACK_WORDS_PER_BLOCK;
+        header.num_blocks = w->num_blocks;
+        header.index_offset = w->offset;
+        header.byte_order = PACK_BYTE_ORDER;
+        header.checksum = checksum_header(&header);
+
+        if (fseek(w->fptr, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, w->fptr) != 1) {
+            fprintf(stderr, "Could not write packed header: %s\n", strerror(errno));
+            error = -1;
+        }
+    }
+
+    if (fclose(w->fptr)) {
+        error = -1;
+    }
+
+    free(w->index);
+    free(w->block);
+    free(w);
+
+    return error;
+}
+
+/*
+** Check the blocks run from the header to the index & the index ends
+** within the file. Everything is a header field that could be anything,
+** so nothing is added or multiplied that could overflow.
+*/
+static int layout_ok(const pack_header_t * h, uint64_t length) {
+    uint64_t        num_words;
+    uint64_t        num_blocks;
+
+    num_words = h->num_digits / PACK_DIGITS_PER_WORD + (h->num_digits % PACK_DIGITS_PER_WORD != 0);
+    num_blocks = num_words / h->words_per_block + (num_words % h->words_per_block != 0);
+
+    if (h->num_blocks != num_blocks) {
+        return 0;
+    }
+
+    /* the last block ends where the index starts, inside the file */
+    if (num_words > (length - sizeof(pack_header_t)) / sizeof(uint64_t) ||
+        h->index_offset != sizeof(pack_header_t) + num_words * sizeof(uint64_t))
+    {
+        return 0;
+    }
+
+    return h->num_blocks <= (length - h->index_offset) / sizeof(pack_index_t);
+}
+
+pack_reader_t * pack_reader_open(const char * pszFilename) {
+    pack_reader_t *     r;
+    struct stat         st;
+    uint64_t            i;
+
+    r = calloc(1, sizeof(pack_reader_t));
+
+    if (r == NULL) {
+        return NULL;
+    }
+
+    r->fd = open(pszFilename, O_RDONLY);
+
+    if (r->fd < 0) {
+        fprintf(stderr, "Could not open packed file '%s': %s\n", pszFilename, strerror(errno));
+        free(r);
+        return NULL;
+    }
+
+    if (fstat(r->fd, &st) || st.st_size < (off_t)sizeof(pack_header_t)) {
+        fprintf(stderr, "'%s' is not a packed digit file\n", pszFilename);
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+
+    r->length = (size_t)st.st_size;
+    r->base = mmap(NULL, r->length, PROT_READ, MAP_SHARED, r->fd, 0);
+
+    if (r->base == MAP_FAILED) {
+        fprintf(stderr, "Could not map packed file '%s': %s\n", pszFilename, strerror(errno));
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+
+    memcpy(&r->header, r->base, sizeof(pack_header_t));
+
+    if (memcmp(r->header.magic, PACK_MAGIC, sizeof(r->header.magic)) ||
+        r->header.version != PACK_VERSION ||
+        r->header.byte_order != PACK_BYTE_ORDER ||
+        r->header.digits_per_word != PACK_DIGITS_PER_WORD ||
+        r->header.words_per_block == 0 ||
+        r->header.checksum != checksum_header(&r->header))
+    {
+        fprintf(stderr, "'%s' has an invalid or foreign packed header\n", pszFilename);
+        pack_reader_close(r);
+        return NULL;
+    }
+
+    if (!layout_ok(&r->header, r->length)) {
+        fprintf(stderr, "'%s' is truncated\n", pszFilename);
+        pack_reader_close(r);
+        return NULL;
+    }
+
+    r->index = (pack_index_t *)(r->base + r->header.index_offset);
+
+    for (i = 0; i < r->header.num_blocks; i++) {
+        if (r->index[i].offset != sizeof(pack_header_t) + (i * r->header.words_per_block * sizeof(uint64_t))) {
+            fprintf(stderr, "'%s' has a corrupt block index\n", pszFilename);
+            pack_reader_close(r);
+            return NULL;
+        }
+    }
+
+    r->verified_block = UINT64_MAX;
+
+    return r;
+}
+
+uint64_t pack_reader_num_digits(pack_reader_t * r) {
+    return r->header.num_digits;
+}
+
+static const uint64_t * reader_block(pack_reader_t * r, uint64_t block) {
+    const uint64_t *    words;
+    uint64_t            n;
+
+    words = (const uint64_t *)(r->base + r->index[block].offset);
+
+    if (block != r->verified_block) {
+        if (block == r->header.num_blocks - 1) {
+            n = ((r->header.num_digits + PACK_DIGITS_PER_WORD - 1) / PACK_DIGITS_PER_WORD) -
+                    (block * r->header.words_per_block);
+        }
+        else {
+            n = r->header.words_per_block;
+        }
+
+        if (checksum_words(words, n) != r->index[block].checksum) {
+            fprintf(stderr, "Checksum mismatch in block %llu\n", (unsigned long long)block);
+            return NULL;
+        }
+
+        r->verified_block = block;
+    }
+
+    return words;
+}
+
+/*
+** Copy digits [start, start + count) into out as ASCII, every
+** block touched is verified against its checksum first.
+*/
+int pack_reader_extract(pack_reader_t * r, uint64_t start, uint64_t count, char * out) {
+    const uint64_t *    words;
+    uint64_t            pos;
+    uint64_t            word_index;
+    uint64_t            word;
+    uint64_t            block;
+    int                 j;
+
+    if (start > r->header.num_digits || count > r->header.num_digits - start) {
+        fprintf(stderr, "Digit range exceeds the %llu digits in file\n", (unsigned long long)r->header.num_digits);
+        return -1;
+    }
+
+    pos = start;
+
+    while (pos < start + count) {
+        word_index = pos / PACK_DIGITS_PER_WORD;
+        block = word_index / r->header.words_per_block;
+
+        words = reader_block(r, block);
+
+        if (words == NULL) {
+            return -1;
+        }
+
+        word = words[word_index % r->header.words_per_block];
+
+        for (j = (int)(pos % PACK_DIGITS_PER_WORD); j < PACK_DIGITS_PER_WORD && pos < start + count; j++, pos++) {
+            *out++ = '0' + (char)((word / pow10_table[PACK_DIGITS_PER_WORD - 1 - j]) % 10);
+        }
+    }
+
+    return 0;
+}
+
+void pack_reader_close(pack_reader_t * r) {
+    munmap((void *)r->base, r->length);
+    close(r->fd);
+    free(r);
+}
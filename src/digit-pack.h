@@ -0,0 +1,58 @@
+/*
+** Packed, random-access storage for pi digits.
+**
+** Digits are packed 19 to a 64-bit word (10^19 < 2^64), most significant
+** digit first, and grouped into fixed-size blocks. The file layout is:
+**
+**   header     - pack_header_t (64 bytes)
+**   blocks     - num_blocks blocks of words_per_block words, the last
+**                block may be short
+**   index      - num_blocks pack_index_t entries, one per block
+**
+** Digit position 0 is the leading '3', position n is the n'th decimal
+** place. A partial final word is padded with trailing zero digits.
+*/
+#ifndef __INCL_DIGIT_PACK
+#define __INCL_DIGIT_PACK
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PACK_MAGIC              "PIDIGITS"
+#define PACK_VERSION            1
+#define PACK_DIGITS_PER_WORD    19
+#define PACK_WORDS_PER_BLOCK    4096
+#define PACK_BYTE_ORDER         0x0102030405060708ULL
+
+typedef struct {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        digits_per_word;
+    uint64_t        num_digits;
+    uint64_t        words_per_block;
+    uint64_t        num_blocks;
+    uint64_t        index_offset;
+    uint64_t        byte_order;
+    uint64_t        checksum;
+}
+pack_header_t;
+
+typedef struct {
+    uint64_t        offset;
+    uint64_t        checksum;
+}
+pack_index_t;
+
+typedef struct _pack_writer     pack_writer_t;
+typedef struct _pack_reader     pack_reader_t;
+
+pack_writer_t * pack_writer_open(const char * pszFilename);
+int             pack_writer_put(pack_writer_t * w, const char * digits, size_t n);
+int             pack_writer_close(pack_writer_t * w);
+
+pack_reader_t * pack_reader_open(const char * pszFilename);
+uint64_t        pack_reader_num_digits(pack_reader_t * r);
+int             pack_reader_extract(pack_reader_t * r, uint64_t start, uint64_t count, char * out);
+void            pack_reader_close(pack_reader_t * r);
+
+#endif
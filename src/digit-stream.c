@@ -0,0 +1,300 @@
+/*
+** Ordered streaming of digits, see digit-stream.h.
+**
+** Buffers are numbered in the order they are filled, buffer n lives in
+** ring slot n % STREAM_BUFFERS. A vmsplice()'d buffer's pages still
+** belong to the pipe after the call returns, and to wherever a reader
+** splice()s or tee()s them on, for as long as they like. They are
+** gifted & never written again: the slot is mapped over with fresh
+** pages before it is filled again.
+*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "digit-stream.h"
+
+struct _stream_writer {
+    int             fd;
+    int             splice;
+    char *          ring;
+    size_t          length[STREAM_BUFFERS];
+    size_t          fill;
+    uint64_t        filled;
+    uint64_t        sent;
+    int             closing;
+    int             error;
+    pthread_t       writer;
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    pthread_cond_t  freed;
+};
+
+static int send_write(int fd, const char * buffer, size_t n) {
+    ssize_t         r;
+
+    while (n > 0) {
+        r = write(fd, buffer, n);
+
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        buffer += r;
+        n -= (size_t)r;
+    }
+
+    return 0;
+}
+
+#if defined (__linux__)
+static int send_splice(stream_writer_t * w, const char * buffer, size_t n) {
+    struct iovec    iov;
+    ssize_t         r;
+
+    while (n > 0) {
+        iov.iov_base = (void *)buffer;
+        iov.iov_len = n;
+
+        r = vmsplice(w->fd, &iov, 1, SPLICE_F_GIFT);
+
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* not supported for this pipe, write the rest */
+            if (errno == EINVAL || errno == ENOSYS) {
+                w->splice = 0;
+                return send_write(w->fd, buffer, n);
+            }
+
+            return -1;
+        }
+
+        buffer += r;
+        n -= (size_t)r;
+    }
+
+    return 0;
+}
+
+/* give a spliced slot new pages, the pipe keeps the old ones */
+static int renew_slot(char * buffer) {
+    void *          p;
+
+    p = mmap(buffer, STREAM_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+    return (p == MAP_FAILED) ? -1 : 0;
+}
+#else
+static int send_splice(stream_writer_t * w, const char * buffer, size_t n) {
+    return send_write(w->fd, buffer, n);
+}
+
+static int renew_slot(char * buffer) {
+    return 0;
+}
+#endif
+
+static void * writer_thread(void * arg) {
+    stream_writer_t *   w = arg;
+    const char *        buffer;
+    size_t              n;
+    int                 error = 0;
+
+    pthread_mutex_lock(&w->lock);
+
+    while (1) {
+        while (w->sent == w->filled && !w->closing) {
+            pthread_cond_wait(&w->ready, &w->lock);
+        }
+
+        if (w->sent == w->filled) {
+            break;
+        }
+
+        buffer = w->ring + (w->sent % STREAM_BUFFERS) * STREAM_BUFFER_SIZE;
+        n = w->length[w->sent % STREAM_BUFFERS];
+
+        pthread_mutex_unlock(&w->lock);
+
+        /* after an error keep taking buffers so the producer can finish */
+        if (!error) {
+            if (w->splice) {
+                error = send_splice(w, buffer, n);
+
+                if (!error) {
+                    error = renew_slot((char *)buffer);
+                }
+            }
+            else {
+                error = send_write(w->fd, buffer, n);
+            }
+
+            if (error) {
+                fprintf(stderr, "Could not write digits: %s\n", strerror(errno));
+            }
+        }
+
+        pthread_mutex_lock(&w->lock);
+
+        w->sent++;
+        w->error |= error;
+
+        pthread_cond_signal(&w->freed);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/*
+** Stream digits to fd, which is closed by stream_writer_close().
+*/
+stream_writer_t * stream_writer_open(int fd) {
+    stream_writer_t *   w;
+    void *              ring;
+#if defined (__linux__)
+    struct stat         st;
+#endif
+
+    ring = mmap(NULL, (size_t)STREAM_BUFFERS * STREAM_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "Could not map stream buffers: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    w = calloc(1, sizeof(stream_writer_t));
+
+    w->fd = fd;
+    w->ring = ring;
+
+#if defined (__linux__)
+    w->splice = (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode));
+#endif
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->ready, NULL);
+    pthread_cond_init(&w->freed, NULL);
+
+    if (pthread_create(&w->writer, NULL, writer_thread, w) != 0) {
+        fprintf(stderr, "Could not start stream writer\n");
+
+        munmap(w->ring, (size_t)STREAM_BUFFERS * STREAM_BUFFER_SIZE);
+        free(w);
+
+        return NULL;
+    }
+
+    return w;
+}
+
+/* hand the buffer being filled to the writer */
+static void submit(stream_writer_t * w) {
+    pthread_mutex_lock(&w->lock);
+
+    w->length[w->filled % STREAM_BUFFERS] = w->fill;
+    w->filled++;
+
+    pthread_cond_signal(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+
+    w->fill = 0;
+}
+
+int stream_writer_put(stream_writer_t * w, const char * digits, size_t n) {
+    char *          buffer;
+    size_t          c;
+    int             error;
+
+    while (n > 0) {
+        if (w->fill == 0) {
+            /* wait for the slot to come free */
+            pthread_mutex_lock(&w->lock);
+
+            while (w->filled - w->sent >= STREAM_BUFFERS) {
+                pthread_cond_wait(&w->freed, &w->lock);
+            }
+
+            error = w->error;
+
+            pthread_mutex_unlock(&w->lock);
+
+            if (error) {
+                return -1;
+            }
+        }
+
+        buffer = w->ring + (w->filled % STREAM_BUFFERS) * STREAM_BUFFER_SIZE;
+
+        c = STREAM_BUFFER_SIZE - w->fill;
+
+        if (c > n) {
+            c = n;
+        }
+
+        memcpy(buffer + w->fill, digits, c);
+
+        w->fill += c;
+        digits += c;
+        n -= c;
+
+        if (w->fill == STREAM_BUFFER_SIZE) {
+            submit(w);
+        }
+    }
+
+    return 0;
+}
+
+/*
+** Write out what is left & close.
+*/
+int stream_writer_close(stream_writer_t * w) {
+    int             error;
+
+    if (w->fill > 0) {
+        submit(w);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_signal(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->writer, NULL);
+
+    error = w->error;
+
+    if (close(w->fd) != 0) {
+        error = -1;
+    }
+
+    munmap(w->ring, (size_t)STREAM_BUFFERS * STREAM_BUFFER_SIZE);
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->ready);
+    pthread_cond_destroy(&w->freed);
+
+    free(w);
+
+    return error ? -1 : 0;
+}
@@ -0,0 +1,25 @@
+/*
+** Ordered streaming of digits to a pipe, socket or file.
+**
+** Digits put to the stream are copied into a bounded ring of page
+** aligned buffers and written out in order by a writer thread, so the
+** producer only waits when the consumer falls a whole ring behind.
+** Full buffers are gifted to a pipe with vmsplice(), the pipe then takes
+** the ring's pages rather than copying them, anything else gets large
+** write() calls.
+*/
+#ifndef __INCL_DIGIT_STREAM
+#define __INCL_DIGIT_STREAM
+
+#include <stddef.h>
+
+#define STREAM_BUFFER_SIZE      (256 * 1024)
+#define STREAM_BUFFERS          8
+
+typedef struct _stream_writer   stream_writer_t;
+
+stream_writer_t *   stream_writer_open(int fd);
+int                 stream_writer_put(stream_writer_t * w, const char * digits, size_t n);
+int                 stream_writer_close(stream_writer_t * w);
+
+#endif
@@ -0,0 +1,316 @@
+/*
+** Memory functions for GMP, see gmp-alloc.h.
+**
+** GMP always passes the size of the block being freed or reallocated,
+** so the kind of block (pooled, malloc'd or mapped) is worked out from
+** its size and no header is needed in front of the limbs.
+*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "gmp.h"
+
+#if defined (__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "gmp-alloc.h"
+
+/*
+** Blocks up to POOL_MAX_SIZE bytes are kept on per-thread free lists,
+** one list per POOL_GRANULE sized class. Blocks of LARGE_MIN bytes or
+** more are mapped in multiples of HUGE_PAGE_SIZE.
+*/
+#define POOL_GRANULE        16
+#define POOL_MAX_SIZE       512
+#define POOL_CLASSES        (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_MAX_FREE       1024
+
+#define HUGE_PAGE_SIZE      (2 * 1024 * 1024)
+#define LARGE_MIN           HUGE_PAGE_SIZE
+
+#define MPOL_PREFERRED      1
+
+#define round_up(x, n)      ((((x) + (n) - 1) / (n)) * (n))
+
+typedef struct _pool_block {
+    struct _pool_block *    next;
+}
+pool_block_t;
+
+static int                              alloc_flags = 0;
+
+static _Thread_local pool_block_t *     pool[POOL_CLASSES];
+static _Thread_local int                pool_free[POOL_CLASSES];
+static _Thread_local int                alloc_node = -1;
+
+static void out_of_memory(size_t size) {
+    fprintf(stderr, "GNU MP: Cannot allocate memory (size=%zu)\n", size);
+    abort();
+}
+
+static int is_pooled(size_t size) {
+    return size <= POOL_MAX_SIZE;
+}
+
+static int is_large(size_t size) {
+    return size >= LARGE_MIN;
+}
+
+static int pool_class(size_t size) {
+    return (int)((size + POOL_GRANULE - 1) / POOL_GRANULE) - 1;
+}
+
+static void * pool_alloc(size_t size) {
+    pool_block_t *      b;
+    int                 c;
+
+    c = pool_class(size);
+    b = pool[c];
+
+    if (b != NULL) {
+        pool[c] = b->next;
+        pool_free[c]--;
+
+        return b;
+    }
+
+    b = malloc((c + 1) * POOL_GRANULE);
+
+    if (b == NULL) {
+        out_of_memory(size);
+    }
+
+    return b;
+}
+
+static void pool_release(void * ptr, size_t size) {
+    pool_block_t *      b = ptr;
+    int                 c;
+
+    c = pool_class(size);
+
+    if (pool_free[c] >= POOL_MAX_FREE) {
+        free(ptr);
+        return;
+    }
+
+    b->next = pool[c];
+    pool[c] = b;
+    pool_free[c]++;
+}
+
+/*
+** Ask for transparent huge pages and, if this thread has a preferred
+** NUMA node, place the pages there when they are first touched.
+*/
+static void large_advise(void * ptr, size_t len) {
+#if defined (MADV_HUGEPAGE)
+    madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+
+#if defined (__linux__) && defined (SYS_mbind)
+    if (alloc_node >= 0 && alloc_node < (int)(sizeof(unsigned long) * 8)) {
+        unsigned long       mask = 1UL << alloc_node;
+
+        syscall(SYS_mbind, ptr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+    }
+#endif
+}
+
+/*
+** Map len bytes aligned to a huge page boundary, so that all of it
+** can be backed by huge pages.
+*/
+static void * map_aligned(size_t len) {
+    uint8_t *       p;
+    uint8_t *       aligned;
+    size_t          head;
+    size_t          tail;
+
+    p = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+
+    aligned = (uint8_t *)round_up((uintptr_t)p, HUGE_PAGE_SIZE);
+    head = aligned - p;
+    tail = HUGE_PAGE_SIZE - head;
+
+    if (head > 0) {
+        munmap(p, head);
+    }
+
+    if (tail > 0) {
+        munmap(aligned + len, tail);
+    }
+
+    return aligned;
+}
+
+static void * large_alloc(size_t size) {
+    void *          p = MAP_FAILED;
+    size_t          len;
+
+    len = round_up(size, HUGE_PAGE_SIZE);
+
+#if defined (MAP_HUGETLB)
+    if (alloc_flags & GMP_ALLOC_HUGETLB) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+
+    if (p == MAP_FAILED) {
+        p = map_aligned(len);
+
+        if (p == NULL) {
+            out_of_memory(size);
+        }
+    }
+
+    large_advise(p, len);
+
+    return p;
+}
+
+static void large_free(void * ptr, size_t size) {
+    munmap(ptr, round_up(size, HUGE_PAGE_SIZE));
+}
+
+static void * large_realloc(void * ptr, size_t old_size, size_t new_size) {
+    void *          p;
+    size_t          old_len;
+    size_t          new_len;
+
+    old_len = round_up(old_size, HUGE_PAGE_SIZE);
+    new_len = round_up(new_size, HUGE_PAGE_SIZE);
+
+    if (old_len == new_len) {
+        return ptr;
+    }
+
+#if defined (__linux__)
+    p = mremap(ptr, old_len, new_len, MREMAP_MAYMOVE);
+
+    if (p != MAP_FAILED) {
+        large_advise(p, new_len);
+        return p;
+    }
+#endif
+
+    p = large_alloc(new_size);
+
+    memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+    large_free(ptr, old_size);
+
+    return p;
+}
+
+static void * alloc_alloc(size_t size) {
+    void *          p;
+
+    if (is_pooled(size)) {
+        return pool_alloc(size);
+    }
+    else if (is_large(size)) {
+        return large_alloc(size);
+    }
+
+    p = malloc(size);
+
+    if (p == NULL) {
+        out_of_memory(size);
+    }
+
+    return p;
+}
+
+static void alloc_free(void * ptr, size_t size) {
+    if (is_pooled(size)) {
+        pool_release(ptr, size);
+    }
+    else if (is_large(size)) {
+        large_free(ptr, size);
+    }
+    else {
+        free(ptr);
+    }
+}
+
+static void * alloc_realloc(void * ptr, size_t old_size, size_t new_size) {
+    void *          p;
+
+    if (is_large(old_size) && is_large(new_size)) {
+        return large_realloc(ptr, old_size, new_size);
+    }
+    else if (is_large(old_size) || is_large(new_size)) {
+        p = alloc_alloc(new_size);
+
+        memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+        alloc_free(ptr, old_size);
+
+        return p;
+    }
+
+    /*
+    ** Pooled and small blocks are both malloc'd, a pooled block just
+    ** has to be at least the size of its class...
+    */
+    if (is_pooled(new_size)) {
+        if (is_pooled(old_size) && pool_class(old_size) == pool_class(new_size)) {
+            return ptr;
+        }
+
+        new_size = (pool_class(new_size) + 1) * POOL_GRANULE;
+    }
+
+    p = realloc(ptr, new_size);
+
+    if (p == NULL) {
+        out_of_memory(new_size);
+    }
+
+    return p;
+}
+
+void gmp_alloc_install(int flags) {
+    alloc_flags = flags;
+
+    mp_set_memory_functions(alloc_alloc, alloc_realloc, alloc_free);
+}
+
+/*
+** Large blocks allocated by this thread from now on prefer NUMA
+** node, or no node in particular if node is -1.
+*/
+void gmp_alloc_set_node(int node) {
+    alloc_node = node;
+}
+
+int gmp_alloc_get_node(void) {
+    return alloc_node;
+}
+
+/*
+** Give this thread's pooled blocks back to malloc, call before a
+** worker thread exits.
+*/
+void gmp_alloc_thread_exit(void) {
+    pool_block_t *      b;
+    int                 c;
+
+    for (c = 0; c < POOL_CLASSES; c++) {
+        while ((b = pool[c]) != NULL) {
+            pool[c] = b->next;
+            free(b);
+        }
+
+        pool_free[c] = 0;
+    }
+}
@@ -0,0 +1,19 @@
+/*
+** Memory functions for GMP, installed with mp_set_memory_functions().
+**
+** Small blocks come from per-thread free lists, large limb arrays are
+** mmap'd directly, advised onto transparent huge pages (or explicit
+** huge pages when asked for) and bound to the calling thread's
+** preferred NUMA node, if one has been set.
+*/
+#ifndef __INCL_GMP_ALLOC
+#define __INCL_GMP_ALLOC
+
+#define GMP_ALLOC_HUGETLB       0x01
+
+void        gmp_alloc_install(int flags);
+void        gmp_alloc_set_node(int node);
+int         gmp_alloc_get_node(void);
+void        gmp_alloc_thread_exit(void);
+
+#endif
@@ -31,7 +31,17 @@
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include "gmp.h"
+#include "digit-pack.h"
+#include "digit-stream.h"
+#include "gmp-alloc.h"
+#include "numa-topo.h"
+#include "progress.h"
+#include "pi-prefix.h"
 
 #define A                   13591409
 #define B                   545140134
@@ -45,6 +55,50 @@
 // how many to display if the user doesn't specify:
 #define DEFAULT_DIGITS      100
 
+#define FORMAT_TEXT         0
+#define FORMAT_PACKED       1
+
+#define COPY_BUFFER_SIZE    65536
+
+/* streamed output is converted down to chunks of this many digits */
+#define STREAM_LEAF_DIGITS  4096
+#define STREAM_MAX_POWERS   48
+
+/*
+** Runs of up to SMALL_DIGITS digits use a static sieve & stacks, no
+** threads and convert to text in memory. SMALL_TERMS is the number of
+** terms they need.
+*/
+#define SMALL_DIGITS        100000
+#define SMALL_TERMS         7100
+#define SMALL_SIEVE_SIZE    (SMALL_TERMS * 6)
+#define SMALL_DEPTH         16
+
+/*
+** -plan memory model, in bytes per digit on top of the sieve, from the
+** peak RSS of 1M to 10M digit runs. Each extra bs() thread holds some
+** of its subtree as well. Time is modelled by the progress cost model,
+** calibrated by timing bs() over PLAN_SAMPLE_DIGITS digits.
+*/
+#define PLAN_BASE_BYTES     (2 * 1024 * 1024)
+#define PLAN_BS_BYTES       10.5
+#define PLAN_LEAN_BYTES     5.2
+#define PLAN_THREAD_BYTES   1.5
+#define PLAN_FINAL_BYTES    4.0
+#define PLAN_OUTPUT_BYTES   10.0
+#define PLAN_WINDOW_BYTES   2.0
+#define PLAN_PACKED_RATIO   0.42
+#define PLAN_THREAD_EFFICIENCY  0.8
+#define PLAN_SAMPLE_DIGITS  500000
+#define PLAN_PACKED_DIGITS  1000000000ULL
+
+/*
+** -time-budget chunks are at least BUDGET_MIN_TERMS terms, and only
+** BUDGET_MARGIN of the time left is planned for.
+*/
+#define BUDGET_MIN_TERMS    64
+#define BUDGET_MARGIN       0.9
+
 static char *   prog_name;
 
 #if CHECK_MEMUSAGE
@@ -74,7 +128,7 @@ static char *   prog_name;
      defined (__SVR4)   || \
      defined (_UNICOS)  || \
      defined (__hpux))
-static int cputime(void) {  
+static int cputime(void) {
     return (int) ((double) clock () * 1000 / CLOCKS_PER_SEC);
 }
 #else
@@ -91,6 +145,20 @@ static int cputime(void) {
 }
 #endif
 
+/* Return wall clock time measured in microseconds.  */
+static int64_t elapsed_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Return wall clock time measured in milliseconds.  */
+static int64_t elapsed(void) {
+    return elapsed_us() / 1000;
+}
+
 /*///////////////////////////////////////////////////////////////////////////*/
 
 static mpf_t        t1;
@@ -217,6 +285,43 @@ static void my_div(mpf_t r, mpf_t y, mpf_t x) {
 }
 #endif
 
+/*
+** f = z, taking over the limbs of z rather than copying them into a
+** second allocation. Only the top prec+1 limbs are kept, as mpf_set_z()
+** would, and z is left as 0. f must not be initialised.
+*/
+static void mpf_init_move_z(mpf_t f, mpz_t z) {
+    void            (*free_func)(void *, size_t);
+    mp_size_t       size;
+    mp_size_t       keep;
+    mp_size_t       prec;
+
+    mpf_init(f);
+
+    size = z->_mp_size < 0 ? -z->_mp_size : z->_mp_size;
+
+    if (size == 0) {
+        return;
+    }
+
+    prec = f->_mp_prec;
+    keep = size < prec + 1 ? size : prec + 1;
+
+    memmove(z->_mp_d, z->_mp_d + (size - keep), keep * sizeof(mp_limb_t));
+
+    z->_mp_size = z->_mp_size < 0 ? -keep : keep;
+    _mpz_realloc(z, prec + 1);
+
+    mp_get_memory_functions(NULL, NULL, &free_func);
+    free_func(f->_mp_d, (prec + 1) * sizeof(mp_limb_t));
+
+    f->_mp_d = z->_mp_d;
+    f->_mp_size = z->_mp_size;
+    f->_mp_exp = size;
+
+    mpz_init(z);
+}
+
 /*///////////////////////////////////////////////////////////////////////////*/
 
 #define min(x,y) ((x) < (y) ? (x) : (y))
@@ -239,11 +344,20 @@ sieve_t;
 
 static sieve_t *        sieve;
 static int64_t          sieve_size;
-static fac_t            ftmp;
-static fac_t            fmul;
+static sieve_t          small_sieve[SMALL_SIEVE_SIZE / 2];
+static _Thread_local fac_t  ftmp;
+static _Thread_local fac_t  fmul;
 
 #define INIT_FACS       32
 
+static void free_sieve(void) {
+    if (sieve != small_sieve) {
+        free(sieve);
+    }
+
+    sieve = NULL;
+}
+
 static void fac_show(fac_t f) {
     int64_t           i;
 
@@ -386,41 +500,229 @@ static void fac_compact(fac_t f) {
     f[0].num_facs = j;
 }
 
-/* convert factorized form to number */
-static void bs_mul(mpz_t r, int64_t a, int64_t b) {
+/*
+** The threads a subtree may use, and the range of NUMA node indexes
+** they run on. A forked subtree takes half the threads and the upper
+** half of the nodes, the forking thread keeps the rest.
+*/
+static int                      bs_threads = 1;
+static _Thread_local int        thread_budget = 1;
+static _Thread_local int        node_lo = 0;
+static _Thread_local int        node_hi = 0;
+
+/*
+** Word sized powers of the small primes, shared by all threads once
+** built: prime_pow[p / 2][e] = p^e for odd p < POW_CACHE_LIMIT, up to
+** the largest e that fits in a word.
+*/
+#define POW_CACHE_LIMIT     256
+#define POW_CACHE_EXP       64
+
+/* above this a factor's power is formed with mpz_ui_pow_ui() */
+#define POW_WORD_MAX        64
+
+/* don't split products or divisions across threads below these */
+#define PARALLEL_MIN_FACS   8192
+#define PARALLEL_MIN_LIMBS  4096
+
+static uint64_t     prime_pow[POW_CACHE_LIMIT / 2][POW_CACHE_EXP];
+static int          prime_pow_max[POW_CACHE_LIMIT / 2];
+
+static void pow_cache_init(void) {
+    uint64_t        p;
+    int             e;
+
+    for (p = 3; p < POW_CACHE_LIMIT; p += 2) {
+        prime_pow[p / 2][0] = 1;
+
+        for (e = 1; e < POW_CACHE_EXP && prime_pow[p / 2][e - 1] <= UINT64_MAX / p; e++) {
+            prime_pow[p / 2][e] = prime_pow[p / 2][e - 1] * p;
+        }
+
+        prime_pow_max[p / 2] = e - 1;
+    }
+}
+
+/*
+** x = fac^e for the largest e <= pow that fits in a word, returns e.
+*/
+static uint64_t word_pow(uint64_t fac, uint64_t pow, uint64_t * x) {
+    uint64_t        e;
+
+    if (fac < POW_CACHE_LIMIT) {
+        e = min(pow, (uint64_t)prime_pow_max[fac / 2]);
+        *x = prime_pow[fac / 2][e];
+
+        return e;
+    }
+
+    for (e = 1, *x = fac; e < pow && *x <= UINT64_MAX / fac; e++) {
+        *x *= fac;
+    }
+
+    return e;
+}
+
+typedef struct {
+    mpz_ptr         r;
+    fac_t *         f;
+    int64_t         a;
+    int64_t         b;
+    int             threads;
+    int             node_lo;
+    int             node_hi;
+    int             node;
+}
+mul_task_t;
+
+static void bs_mul(mpz_t r, fac_t f, int64_t a, int64_t b);
+
+static void * bs_mul_worker(void * arg) {
+    mul_task_t *    task = arg;
+
+    thread_budget = task->threads;
+    node_lo = task->node_lo;
+    node_hi = task->node_hi;
+
+    numa_topo_bind_thread(node_lo);
+    gmp_alloc_set_node(task->node);
+
+    bs_mul(task->r, *task->f, task->a, task->b);
+
+    gmp_alloc_thread_exit();
+
+    return NULL;
+}
+
+/*
+** convert factorized form to number, the factors are packed into
+** words so there is one mpz_mul_ui() per word rather than per factor.
+** Big enough halves of the product tree go to another thread with
+** half of this thread's budget while it has more than one to spare.
+*/
+static void bs_mul(mpz_t r, fac_t f, int64_t a, int64_t b) {
     int64_t         i;
-    int64_t         j;
+    uint64_t        pow;
+    uint64_t        w;
+    uint64_t        x;
 
     if (b - a <= 32) {
+        mpz_t           t;
+
         mpz_set_ui(r, 1);
+        w = 1;
 
         for (i = a; i < b; i++) {
-            for (j = 0; j < fmul[0].pow[i]; j++) {
-                mpz_mul_ui(r, r, fmul[0].fac[i]);
+            pow = f[0].pow[i];
+
+            if (pow > POW_WORD_MAX) {
+                mpz_init(t);
+                mpz_ui_pow_ui(t, f[0].fac[i], pow);
+                mpz_mul(r, r, t);
+                mpz_clear(t);
+
+                continue;
+            }
+
+            while (pow > 0) {
+                pow -= word_pow(f[0].fac[i], pow, &x);
+
+                if (w > UINT64_MAX / x) {
+                    mpz_mul_ui(r, r, w);
+                    w = 1;
+                }
+
+                w *= x;
             }
         }
+
+        mpz_mul_ui(r, r, w);
     }
     else {
         mpz_t           r2;
+        mul_task_t      task;
+        pthread_t       thread;
+        int             budget = thread_budget;
 
         mpz_init(r2);
 
-        bs_mul(r2, a, (a + b) >> 1);
-        bs_mul(r, (a + b) >> 1, b);
+        if (budget > 1 && b - a >= PARALLEL_MIN_FACS) {
+            task.r = r2;
+            task.f = (fac_t *)f;
+            task.a = a;
+            task.b = (a + b) >> 1;
+            task.threads = budget / 2;
+            task.node_lo = node_lo;
+            task.node_hi = node_hi;
+            task.node = gmp_alloc_get_node();
+
+            thread_budget = budget - task.threads;
+
+            if (pthread_create(&thread, NULL, bs_mul_worker, &task) == 0) {
+                bs_mul(r, f, (a + b) >> 1, b);
+                pthread_join(thread, NULL);
+            }
+            else {
+                thread_budget = budget;
+
+                bs_mul(r2, f, a, (a + b) >> 1);
+                bs_mul(r, f, (a + b) >> 1, b);
+            }
+
+            thread_budget = budget;
+        }
+        else {
+            bs_mul(r2, f, a, (a + b) >> 1);
+            bs_mul(r, f, (a + b) >> 1, b);
+        }
 
         mpz_mul(r, r, r2);
         mpz_clear(r2);
     }
 }
 
-static mpz_t            gcd;
+static _Thread_local mpz_t  gcd;
 
 #if HAVE_DIVEXACT_PREINV
-static mpz_t    mgcd;
+static _Thread_local mpz_t  mgcd;
 void mpz_invert_mod_2exp (mpz_ptr, mpz_srcptr);
 void mpz_divexact_pre (mpz_ptr, mpz_srcptr, mpz_srcptr, mpz_srcptr);
+#define MGCD mgcd
+#else
+#define MGCD NULL
 #endif
 
+/* q /= d, where d divides q exactly and m is d's inverse mod 2^n */
+static void divexact_gcd(mpz_t q, mpz_t d, mpz_t m) {
+    #if HAVE_DIVEXACT_PREINV
+    mpz_divexact_pre (q, q, d, m);
+    #else
+    mpz_divexact(q, q, d);
+    #endif
+}
+
+typedef struct {
+    mpz_ptr         q;
+    mpz_ptr         d;
+    mpz_ptr         m;
+    int             node_lo;
+    int             node;
+}
+div_task_t;
+
+static void * divexact_worker(void * arg) {
+    div_task_t *    task = arg;
+
+    numa_topo_bind_thread(task->node_lo);
+    gmp_alloc_set_node(task->node);
+
+    divexact_gcd(task->q, task->d, task->m);
+
+    gmp_alloc_thread_exit();
+
+    return NULL;
+}
+
 /* f /= gcd(f,g), g /= gcd(f,g) */
 static void fac_remove_gcd(mpz_t p, fac_t fp, mpz_t g, fac_t fg) {
     int64_t         i;
@@ -456,18 +758,45 @@ static void fac_remove_gcd(mpz_t p, fac_t fp, mpz_t g, fac_t fg) {
     assert(k <= fmul->max_facs);
 
     if (fmul->num_facs) {
-        bs_mul(gcd, 0, fmul->num_facs);
+        bs_mul(gcd, fmul, 0, fmul->num_facs);
 
         #if HAVE_DIVEXACT_PREINV
         mpz_invert_mod_2exp (mgcd, gcd);
-        mpz_divexact_pre (p, p, gcd, mgcd);
-        mpz_divexact_pre (g, g, gcd, mgcd);
-        #else
-        #define SIZ(x) x->_mp_size
-        mpz_divexact(p, p, gcd);
-        mpz_divexact(g, g, gcd);
         #endif
-        
+
+        /*
+        ** The two divisions are independent, with threads to spare
+        ** g is divided in another one, which takes one of the budget...
+        */
+        if (thread_budget > 1 && mpz_size(g) >= PARALLEL_MIN_LIMBS) {
+            div_task_t      task;
+            pthread_t       thread;
+            int             budget = thread_budget;
+
+            task.q = g;
+            task.d = gcd;
+            task.m = MGCD;
+            task.node_lo = node_lo;
+            task.node = gmp_alloc_get_node();
+
+            thread_budget = budget - 1;
+
+            if (pthread_create(&thread, NULL, divexact_worker, &task) == 0) {
+                divexact_gcd(p, gcd, MGCD);
+                pthread_join(thread, NULL);
+            }
+            else {
+                divexact_gcd(p, gcd, MGCD);
+                divexact_gcd(g, gcd, MGCD);
+            }
+
+            thread_budget = budget;
+        }
+        else {
+            divexact_gcd(p, gcd, MGCD);
+            divexact_gcd(g, gcd, MGCD);
+        }
+
         fac_compact(fp);
         fac_compact(fg);
     }
@@ -475,224 +804,1947 @@ static void fac_remove_gcd(mpz_t p, fac_t fp, mpz_t g, fac_t fg) {
 
 /*///////////////////////////////////////////////////////////////////////////*/
 
-static int          out = 0;
-static mpz_t *      pstack;
-static mpz_t *      qstack;
-static mpz_t *      gstack;
-static fac_t *      fpstack;
-static fac_t *      fgstack;
-static int64_t      top = 0;
-static int64_t      gcd_time = 0;
-static double       progress = 0;
-static double       percent;
+/*
+** -check, P, Q & G are also kept mod a few 61 bit primes. Leaves are
+** reduced directly and merges use the same formulas, so the residues
+** don't depend on the big numbers at all. Merges at levels up to
+** check_level compare the two, a corrupted multiply is caught at the
+** first checked level above where it happened. Each residue is a
+** fraction n / d so removing a gcd needs no inverse mod the prime.
+*/
+#define CHECK_PRIMES        3
+#define CHECK_2EXP61        ((uint64_t)1 << 61)
 
-#define p1 (pstack[top])
-#define q1 (qstack[top])
-#define g1 (gstack[top])
-#define fp1 (fpstack[top])
-#define fg1 (fgstack[top])
+__extension__ typedef unsigned __int128 uint128_t;
 
-#define p2 (pstack[top+1])
-#define q2 (qstack[top+1])
-#define g2 (gstack[top+1])
-#define fp2 (fpstack[top+1])
-#define fg2 (fgstack[top+1])
+typedef struct {
+    uint64_t        n;
+    uint64_t        d;
+}
+frac_t;
 
-/* binary splitting */
-static void bs(uint64_t a, uint64_t b, uint64_t gflag, int64_t level) {
-    uint64_t      i;
-    uint64_t      mid;
-    int           ccc;
+typedef struct {
+    frac_t          p[CHECK_PRIMES];
+    frac_t          q[CHECK_PRIMES];
+    frac_t          g[CHECK_PRIMES];
+}
+residue_t;
 
-    if (b - a == 1) {
-        /*
-        ** g(b-1,b) = (6b-5)(2b-1)(6b-1)
-        ** p(b-1,b) = b^3 * C^3 / 24
-        ** q(b-1,b) = (-1)^b*g(b-1,b)*(A+Bb).
-        */
-        mpz_set_ui(p1, b);
-        mpz_mul_ui(p1, p1, b);
-        mpz_mul_ui(p1, p1, b);
-        mpz_mul_ui(p1, p1, (C / 24) * (C / 24));
-        mpz_mul_ui(p1, p1, C * 24);
+static const uint64_t   check_primes[CHECK_PRIMES] = {
+    2305843009213693951ULL,         /* 2^61 - 1 */
+    2305843009213693921ULL,         /* 2^61 - 31 */
+    2305843009213693907ULL          /* 2^61 - 45 */
+};
 
-        mpz_set_ui(g1, (2 * b) - 1);
-        mpz_mul_ui(g1, g1, (6 * b) - 1);
-        mpz_mul_ui(g1, g1, (6 * b) - 5);
+static int              check_level = -1;
+static int64_t          check_time = 0;
 
-        mpz_set_ui(q1, b);
-        mpz_mul_ui(q1, q1, B);
-        mpz_add_ui(q1, q1, A);
-        mpz_mul   (q1, q1, g1);
+/*
+** x.y mod m for m = 2^61 - c, folding the product down with 2^61 = c
+** rather than dividing.
+*/
+static uint64_t mul_mod(uint64_t x, uint64_t y, uint64_t m) {
+    uint128_t       t;
+    uint64_t        c;
+    uint64_t        r;
 
-        if (b % 2) {
-            mpz_neg(q1, q1);
-        }
+    c = CHECK_2EXP61 - m;
+    t = (uint128_t)x * y;
 
-        i = b;
+    t = (t & (CHECK_2EXP61 - 1)) + (t >> 61) * c;
+    t = (t & (CHECK_2EXP61 - 1)) + (t >> 61) * c;
 
-        while ((i & 1) == 0) {
-            i >>= 1;
-        }
+    r = (uint64_t)t;
+
+    return r >= m ? r - m : r;
+}
+
+static void residue_set(residue_t * r, uint64_t p, uint64_t q, uint64_t g) {
+    int             k;
+
+    for (k = 0; k < CHECK_PRIMES; k++) {
+        r->p[k].n = p;
+        r->q[k].n = q;
+        r->g[k].n = g;
+        r->p[k].d = r->q[k].d = r->g[k].d = 1;
+    }
+}
 
-        fac_set_bp(fp1, i, 3);	/*  b^3 */
-        fac_mul_bp(fp1, 3 * 5 * 23 * 29, 3);
+/* the residues of leaf b, as bs() works it out */
+static void residue_leaf(residue_t * r, uint64_t b) {
+    uint64_t        m;
+    uint64_t        p;
+    uint64_t        q;
+    uint64_t        g;
+    int             k;
 
-        fp1[0].pow[0]--;
+    for (k = 0; k < CHECK_PRIMES; k++) {
+        m = check_primes[k];
 
-        fac_set_bp(fg1, (2 * b) - 1, 1);	/* 2b-1 */
-        fac_mul_bp(fg1, (6 * b) - 1, 1);	/* 6b-1 */
-        fac_mul_bp(fg1, (6 * b) - 5, 1);	/* 6b-5 */
+        p = mul_mod(mul_mod(b, b, m), b, m);
+        p = mul_mod(p, (C / 24) * (C / 24), m);
+        p = mul_mod(p, C * 24, m);
 
-        if (b > (int)(progress)) {
-            printf(".");
-            fflush(stdout);
+        g = mul_mod(mul_mod((2 * b) - 1, (6 * b) - 1, m), (6 * b) - 5, m);
 
-            progress += percent * 2;
+        q = mul_mod(mul_mod(b, B, m) + A, g, m);
+
+        if (b % 2) {
+            q = (m - q) % m;
         }
+
+        r->p[k].n = p;
+        r->q[k].n = q;
+        r->g[k].n = g;
+        r->p[k].d = r->q[k].d = r->g[k].d = 1;
     }
-    else {
-        /*
-        ** p(a,b) = p(a,m) * p(m,b)
-        ** g(a,b) = g(a,m) * g(m,b)
-        ** q(a,b) = q(a,m) * p(m,b) + q(m,b) * g(a,m)
-        */
-        mid = a + ((b - a) * 0.5224);     /* tuning parameter */
-        bs(a, mid, 1, level + 1);
+}
 
-        top++;
+/*
+** p(m,b) & g(a,m) have been divided by gcd. Any common factor keeps
+** the merge right, so gcd itself needn't be checked.
+*/
+static void residue_remove_gcd(residue_t * rp, residue_t * rg, mpz_t gcd) {
+    uint64_t        m;
+    uint64_t        d;
+    int             k;
 
-        bs(mid, b, gflag, level + 1);
+    for (k = 0; k < CHECK_PRIMES; k++) {
+        m = check_primes[k];
+        d = mpz_fdiv_ui(gcd, m);
 
-        top--;
+        rp->p[k].d = mul_mod(rp->p[k].d, d, m);
+        rg->g[k].d = mul_mod(rg->g[k].d, d, m);
+    }
+}
 
-        if (level == 0) {
-            puts ("");
-        }
+/* r1 = the residues of (a,b) from those of (a,m) in r1 & (m,b) in r2 */
+static void residue_merge(residue_t * r1, residue_t * r2, uint64_t gflag) {
+    uint64_t        m;
+    uint64_t        x;
+    uint64_t        y;
+    int             k;
 
-        ccc = (level == 0);
+    for (k = 0; k < CHECK_PRIMES; k++) {
+        m = check_primes[k];
 
-        if (ccc) {
-            CHECK_MEMUSAGE;
-        }
+        /* q1 / qd1 . p2 / pd2 + q2 / qd2 . g1 / gd1 */
+        x = mul_mod(r2->q[k].d, r1->g[k].d, m);
+        y = mul_mod(r1->q[k].d, r2->p[k].d, m);
 
-        if (level >= 4) {           /* tuning parameter */
-            #if 0
-            long t = cputime();
-            #endif
+        r1->q[k].n = (
+            mul_mod(mul_mod(r1->q[k].n, r2->p[k].n, m), x, m) +
+            mul_mod(mul_mod(r2->q[k].n, r1->g[k].n, m), y, m)) % m;
+        r1->q[k].d = mul_mod(x, y, m);
 
-            fac_remove_gcd(p2, fp2, g1, fg1);
-            
-            #if 0
-            gcd_time += cputime()-t;
-            #endif
-        }
+        r1->p[k].n = mul_mod(r1->p[k].n, r2->p[k].n, m);
+        r1->p[k].d = mul_mod(r1->p[k].d, r2->p[k].d, m);
 
-        if (ccc) {
-            CHECK_MEMUSAGE;
+        if (gflag) {
+            r1->g[k].n = mul_mod(r1->g[k].n, r2->g[k].n, m);
+            r1->g[k].d = mul_mod(r1->g[k].d, r2->g[k].d, m);
         }
+    }
+}
 
-        mpz_mul(p1, p1, p2);
+/* x mod m is f, i.e. (x mod m).d = n */
+static int residue_matches(mpz_t x, frac_t * f, uint64_t m) {
+    return mul_mod(mpz_fdiv_ui(x, m), f->d, m) == f->n;
+}
 
-        if (ccc) {
-            CHECK_MEMUSAGE;
+/* compare p, q & g of (a,b) with their residues, bail out if they differ */
+static void residue_check(residue_t * r, mpz_t p, mpz_t q, mpz_t g, uint64_t gflag, uint64_t a, uint64_t b, int64_t level) {
+    uint64_t        m;
+    int64_t         t = elapsed_us();
+    int             k;
+
+    for (k = 0; k < CHECK_PRIMES; k++) {
+        m = check_primes[k];
+
+        if (!residue_matches(p, &r->p[k], m) ||
+            !residue_matches(q, &r->q[k], m) ||
+            (gflag && !residue_matches(g, &r->g[k], m)))
+        {
+            fprintf(
+                stderr,
+                "Check failed for terms [%llu, %llu) at level %lld, mod %llu\n",
+                (unsigned long long)a,
+                (unsigned long long)b,
+                (long long)level,
+                (unsigned long long)m);
+
+            exit(EXIT_FAILURE);
         }
+    }
 
-        mpz_mul(q1, q1, p2);
+    __atomic_add_fetch(&check_time, elapsed_us() - t, __ATOMIC_RELAXED);
+}
 
-        if (ccc) {
-            CHECK_MEMUSAGE;
-        }
+/*///////////////////////////////////////////////////////////////////////////*/
 
-        mpz_mul(q2, q2, g1);
+/*
+** -truncate, bs() nodes are only worked out to the relative precision
+** their part of the final result needs. Their p, q & g are then x.2^e,
+** with the exponents on estack.
+**
+** At a merge q1.p2 is bigger than q2.g1 by about g1/p1, at least
+** TRUNCATE_TERM_BITS a term less a little for (A + Bm) / (A + Ba),
+** so q2 & g1 need that much less precision than q. Right down the
+** tree the right hand q's & left hand g's can go at the top levels.
+** Results are truncated to their precision plus TRUNCATE_GUARD bits,
+** which covers the errors summed over the levels.
+*/
+#define TRUNCATE_TERM_BITS  47
+#define TRUNCATE_GUARD      64
 
-        if (ccc) {
-            CHECK_MEMUSAGE;
-        }
+/* precisions in bits, 0 for exact, or binary exponents */
+typedef struct {
+    int64_t         p;
+    int64_t         q;
+    int64_t         g;
+}
+bs_bits_t;
 
-        mpz_add(q1, q1, q2);
+static const bs_bits_t  bs_exact = {0, 0, 0};
 
-        if (ccc) {
-            CHECK_MEMUSAGE;
-        }
+/* the larger of two precisions, exact beats anything */
+static int64_t prec_max(int64_t x, int64_t y) {
+    return (x == 0 || y == 0) ? 0 : max(x, y);
+}
 
-        fac_mul(fp1, fp2);
+static int64_t prec_less(int64_t x, int64_t bits) {
+    return (x == 0) ? 0 : max(x - bits, 1);
+}
 
-        if (gflag) {
-            mpz_mul(g1, g1, g2);
-            fac_mul(fg1, fg2);
-        }
+/* the precisions the halves of (a,b) split at mid are needed to */
+static void prec_split(bs_bits_t prec, uint64_t a, uint64_t mid, uint64_t gflag, bs_bits_t * left, bs_bits_t * right) {
+    int64_t         shift;
+
+    shift = TRUNCATE_TERM_BITS * (int64_t)(mid - a) - (int64_t)log2(1.0 + (double)B * mid / A) - 1;
+
+    left->p = prec.p;
+    left->q = prec.q;
+    left->g = prec_less(prec.q, shift);
+
+    if (gflag) {
+        left->g = prec_max(left->g, prec.g);
     }
 
-    if (out & 2) {
-        printf("p(%llu, %llu) = ", a, b);
-        fac_show(fp1);
+    right->p = prec_max(prec.p, prec.q);
+    right->q = prec_less(prec.q, shift);
+    right->g = prec.g;
+}
 
-        if (gflag) {
-            printf("g(%llu, %llu) = ", a ,b);
-            fac_show(fg1);
+/* drop the low bits of x.2^e beyond prec plus the guard bits */
+static void truncate_to(mpz_t x, int64_t * e, int64_t prec) {
+    int64_t         bits;
+
+    if (prec > 0) {
+        bits = (int64_t)mpz_sizeinbase(x, 2) - prec - TRUNCATE_GUARD;
+
+        if (bits > 0) {
+            mpz_tdiv_q_2exp(x, x, bits);
+            *e += bits;
         }
     }
 }
 
-static void build_sieve(long int n, sieve_t *s) {
-    int64_t           m;
-    int64_t           i;
-    int64_t           j;
-    int64_t           k;
+/*
+** x.2^ex + y.2^ey into x, returns its exponent. The term with the
+** smaller exponent is truncated to the other's, it is the smaller one
+** and its low bits are below the other's precision.
+*/
+static int64_t add_scaled(mpz_t x, int64_t ex, mpz_t y, int64_t ey) {
+    if (ex > ey) {
+        mpz_tdiv_q_2exp(y, y, ex - ey);
+    }
+    else if (ey > ex) {
+        mpz_tdiv_q_2exp(x, x, ey - ex);
+    }
 
-    sieve_size = n;
-    m = (int64_t)sqrt(n);
-    memset(s, 0, sizeof(sieve_t) * n / 2);
+    mpz_add(x, x, y);
 
-    s[1 / 2].fac = 1;
-    s[1 / 2].pow = 1;
+    return max(ex, ey);
+}
+
+/*///////////////////////////////////////////////////////////////////////////*/
+
+/*
+** Each thread running bs() has its own stacks & scratch factors, the
+** sieve is shared and read only.
+*/
+static int                      out = 0;
+static _Thread_local mpz_t *    pstack;
+static _Thread_local mpz_t *    qstack;
+static _Thread_local mpz_t *    gstack;
+static _Thread_local fac_t *    fpstack;
+static _Thread_local fac_t *    fgstack;
+static _Thread_local residue_t *    rstack;
+static _Thread_local bs_bits_t *    estack;
+static _Thread_local int64_t    top = 0;
+static _Thread_local int64_t    stack_depth = 0;
+static int64_t                  gcd_time = 0;
+static int                      lean = 0;
+static uint64_t                 last_term = 0;
+
+/* where bs() splits its range, tuning parameter */
+#define BS_SPLIT            0.5224
+
+/* don't fork subtrees smaller than this */
+#define PARALLEL_MIN_TERMS  1024
+
+typedef struct {
+    uint64_t        a;
+    uint64_t        b;
+    uint64_t        gflag;
+    int64_t         level;
+    int64_t         depth;
+    bs_bits_t       prec;
+    int             threads;
+    int             node_lo;
+    int             node_hi;
+    mpz_t           p;
+    mpz_t           q;
+    mpz_t           g;
+    fac_t           fp;
+    fac_t           fg;
+    residue_t       r;
+    bs_bits_t       e;
+}
+bs_task_t;
+
+#define p1 (pstack[top])
+#define q1 (qstack[top])
+#define g1 (gstack[top])
+#define fp1 (fpstack[top])
+#define fg1 (fgstack[top])
+#define r1 (rstack[top])
+#define e1 (estack[top])
+
+/*
+** In -lean mode, merge operands bigger than this are freed as soon
+** as they're used rather than kept for the next sibling, and stack
+** levels below the merge are freed for the top LEAN_LEVELS levels.
+*/
+#define LEAN_LIMBS      4096
+#define LEAN_FACS       4096
+#define LEAN_LEVELS     6
+
+#define p2 (pstack[top+1])
+#define q2 (qstack[top+1])
+#define g2 (gstack[top+1])
+#define fp2 (fpstack[top+1])
+#define fg2 (fgstack[top+1])
+#define r2 (rstack[top+1])
+#define e2 (estack[top+1])
+
+static void mpz_release(mpz_t x) {
+    mpz_clear(x);
+    mpz_init(x);
+}
+
+static void lean_release(mpz_t x) {
+    if (x->_mp_alloc > LEAN_LIMBS) {
+        mpz_release(x);
+    }
+}
+
+static void lean_release_fac(fac_t f) {
+    if (f[0].max_facs > LEAN_FACS) {
+        fac_clear(f);
+        fac_init(f);
+    }
+}
+
+/* stacks for small runs, which only have the one thread */
+static mpz_t                    small_pstack[SMALL_DEPTH];
+static mpz_t                    small_qstack[SMALL_DEPTH];
+static mpz_t                    small_gstack[SMALL_DEPTH];
+static fac_t                    small_fpstack[SMALL_DEPTH];
+static fac_t                    small_fgstack[SMALL_DEPTH];
+static residue_t                small_rstack[SMALL_DEPTH];
+static bs_bits_t                small_estack[SMALL_DEPTH];
+
+/* allocate this thread's stacks & scratch space for bs() */
+static void bs_thread_init(int64_t depth) {
+    int64_t         i;
+
+    stack_depth = depth;
+    top = 0;
+
+    if (depth <= SMALL_DEPTH && bs_threads == 1) {
+        pstack =    small_pstack;
+        qstack =    small_qstack;
+        gstack =    small_gstack;
+        fpstack =   small_fpstack;
+        fgstack =   small_fgstack;
+        rstack =    small_rstack;
+        estack =    small_estack;
+    }
+    else {
+        pstack =    malloc(sizeof(mpz_t) * depth);
+        qstack =    malloc(sizeof(mpz_t) * depth);
+        gstack =    malloc(sizeof(mpz_t) * depth);
+        fpstack =   malloc(sizeof(fac_t) * depth);
+        fgstack =   malloc(sizeof(fac_t) * depth);
+        rstack =    malloc(sizeof(residue_t) * depth);
+        estack =    malloc(sizeof(bs_bits_t) * depth);
+    }
+
+    for (i = 0; i < depth; i++) {
+        mpz_init(pstack[i]);
+        mpz_init(qstack[i]);
+        mpz_init(gstack[i]);
+
+        fac_init(fpstack[i]);
+        fac_init(fgstack[i]);
+    }
+
+    mpz_init(gcd);
+
+    #if HAVE_DIVEXACT_PREINV
+    mpz_init(mgcd);
+    #endif
+
+    fac_init(ftmp);
+    fac_init(fmul);
+}
+
+static void bs_thread_clear(void) {
+    int64_t         i;
+
+    #if HAVE_DIVEXACT_PREINV
+    mpz_clear(mgcd);
+    #endif
+
+    mpz_clear(gcd);
+    fac_clear(ftmp);
+    fac_clear(fmul);
+
+    for (i = 0; i < stack_depth; i++) {
+        mpz_clear(pstack[i]);
+        mpz_clear(qstack[i]);
+        mpz_clear(gstack[i]);
+
+        fac_clear(fpstack[i]);
+        fac_clear(fgstack[i]);
+    }
+
+    if (pstack != small_pstack) {
+        free(pstack);
+        free(qstack);
+        free(gstack);
+        free(fpstack);
+        free(fgstack);
+        free(rstack);
+        free(estack);
+    }
+}
+
+static void fac_swap(fac_t f, fac_t g) {
+    fac_t       tmp;
+
+    tmp[0] = f[0];
+    f[0]   = g[0];
+    g[0]   = tmp[0];
+}
+
+static void bs(uint64_t a, uint64_t b, uint64_t gflag, int64_t level, bs_bits_t prec);
+
+/*
+** Worker thread running one subtree of bs(). It moves onto its own
+** node first so its stacks, and the results it hands back, are
+** allocated in that node's memory.
+*/
+static void * bs_worker(void * arg) {
+    bs_task_t *     task = arg;
+
+    thread_budget = task->threads;
+    node_lo = task->node_lo;
+    node_hi = task->node_hi;
+
+    numa_topo_bind_thread(node_lo);
+
+    if (numa_topo_num_nodes() > 1) {
+        gmp_alloc_set_node(numa_topo_node_id(node_lo));
+    }
+
+    bs_thread_init(task->depth);
+
+    bs(task->a, task->b, task->gflag, task->level, task->prec);
+
+    mpz_init(task->p);
+    mpz_init(task->q);
+    mpz_init(task->g);
+    fac_init(task->fp);
+    fac_init(task->fg);
+
+    mpz_swap(task->p, p1);
+    mpz_swap(task->q, q1);
+    mpz_swap(task->g, g1);
+    fac_swap(task->fp, fp1);
+    fac_swap(task->fg, fg1);
+
+    task->r = r1;
+    task->e = e1;
+
+    bs_thread_clear();
+    gmp_alloc_thread_exit();
+
+    return NULL;
+}
+
+/*
+** bs(a, mid) & bs(mid, b) in parallel, leaving the results in p1 & p2
+** etc. just as the sequential calls would.
+*/
+static void bs_fork(uint64_t a, uint64_t mid, uint64_t b, uint64_t gflag, int64_t level, bs_bits_t left, bs_bits_t right) {
+    bs_task_t       task;
+    pthread_t       thread;
+    int             budget = thread_budget;
+    int             lo = node_lo;
+    int             hi = node_hi;
+
+    task.a = mid;
+    task.b = b;
+    task.gflag = gflag;
+    task.level = level + 1;
+    task.depth = stack_depth;
+    task.prec = right;
+    task.threads = budget / 2;
+    task.node_lo = lo;
+    task.node_hi = hi;
+
+    if (hi > lo) {
+        task.node_lo = lo + ((hi - lo + 1) / 2);
+        node_hi = task.node_lo - 1;
+    }
+
+    thread_budget = budget - task.threads;
+
+    if (pthread_create(&thread, NULL, bs_worker, &task) != 0) {
+        thread_budget = budget;
+        node_hi = hi;
+
+        bs(a, mid, 1, level + 1, left);
+
+        top++;
+        bs(mid, b, gflag, level + 1, right);
+        top--;
+
+        return;
+    }
+
+    bs(a, mid, 1, level + 1, left);
+
+    pthread_join(thread, NULL);
+
+    thread_budget = budget;
+    node_hi = hi;
+
+    mpz_swap(p2, task.p);
+    mpz_swap(q2, task.q);
+    mpz_swap(g2, task.g);
+    fac_swap(fp2, task.fp);
+    fac_swap(fg2, task.fg);
+
+    r2 = task.r;
+    e2 = task.e;
+
+    mpz_clear(task.p);
+    mpz_clear(task.q);
+    mpz_clear(task.g);
+    fac_clear(task.fp);
+    fac_clear(task.fg);
+}
+
+/*///////////////////////////////////////////////////////////////////////////*/
+
+/*
+** Fixed size nodes. The lower levels of bs() are hundreds of thousands
+** of nodes of a few limbs each, where allocating, reallocing & size
+** dispatch in the mpz_t calls costs as much as the multiplies. Nodes
+** of up to FIXED_MAX_TERMS terms are worked out in limb arrays on the
+** C stack instead, only the result goes into the mpz_t's on the stack.
+**
+** For b < FIXED_MAX_B a leaf's p fits in 3 limbs, g in 2 & q in 4.
+** Limb counts add when multiplied, so a node of n terms needs at most
+** 3n, 4n & 2n limbs, the carry of q1.p2 + q2.g1 included. The sign of
+** q is kept apart, the sum is a subtraction when the signs differ.
+** The common factors aren't removed in these nodes but the factors of
+** p & g are still worked out for the levels above.
+*/
+#define FIXED_MAX_TERMS     16
+#define FIXED_MAX_B         (1ULL << 40)
+
+#define FIXED_P_LIMBS(n)    (3 * (n))
+#define FIXED_Q_LIMBS(n)    (4 * (n))
+#define FIXED_G_LIMBS(n)    (2 * (n))
+#define FIXED_LIMBS(n)      (FIXED_P_LIMBS(n) + FIXED_Q_LIMBS(n) + FIXED_G_LIMBS(n))
+
+/* both children & q1.p2, q2.g1 */
+#define FIXED_SCRATCH(n)    (FIXED_LIMBS(n) + 2 * FIXED_Q_LIMBS(n))
+
+typedef struct {
+    mp_limb_t *     p;
+    mp_limb_t *     q;
+    mp_limb_t *     g;
+    mp_size_t       np;
+    mp_size_t       nq;
+    mp_size_t       ng;
+    int             sq;
+    residue_t       r;
+}
+fixed_t;
+
+static void fixed_bs(uint64_t a, uint64_t b, uint64_t gflag, fixed_t * x);
+
+/* give x the room for n terms at limbs, returns what is left */
+static mp_limb_t * fixed_place(fixed_t * x, mp_limb_t * limbs, uint64_t n) {
+    x->p = limbs;
+    x->q = x->p + FIXED_P_LIMBS(n);
+    x->g = x->q + FIXED_Q_LIMBS(n);
+
+    return x->g + FIXED_G_LIMBS(n);
+}
+
+/* x *= v */
+static void fixed_mul_1(mp_limb_t * x, mp_size_t * n, mp_limb_t v) {
+    mp_limb_t       c;
+
+    c = mpn_mul_1(x, x, *n, v);
+
+    if (c) {
+        x[(*n)++] = c;
+    }
+}
+
+/* r = u.v, returns the size of r */
+static mp_size_t fixed_mul(mp_limb_t * r, const mp_limb_t * u, mp_size_t nu, const mp_limb_t * v, mp_size_t nv) {
+    if (nu < nv) {
+        return fixed_mul(r, v, nv, u, nu);
+    }
+
+    if (nv == 0) {
+        return 0;
+    }
+
+    mpn_mul(r, u, nu, v, nv);
+
+    return nu + nv - (r[nu + nv - 1] == 0);
+}
+
+/* x->q = u + v, su & sv are set for negative u & v */
+static void fixed_add(fixed_t * x, const mp_limb_t * u, mp_size_t nu, int su, const mp_limb_t * v, mp_size_t nv, int sv) {
+    mp_limb_t       c;
+
+    if (nu < nv || (nu == nv && mpn_cmp(u, v, nu) < 0)) {
+        fixed_add(x, v, nv, sv, u, nu, su);
+        return;
+    }
+
+    /* |u| >= |v| */
+    if (su == sv) {
+        c = mpn_add(x->q, u, nu, v, nv);
+        x->nq = nu;
+
+        if (c) {
+            x->q[x->nq++] = c;
+        }
+    }
+    else {
+        mpn_sub(x->q, u, nu, v, nv);
+        x->nq = nu;
+
+        while (x->nq > 0 && x->q[x->nq - 1] == 0) {
+            x->nq--;
+        }
+    }
+
+    x->sq = su && x->nq > 0;
+}
+
+static void fixed_leaf(uint64_t b, fixed_t * x) {
+    mp_limb_t       t[2];
+    mp_size_t       nt = 1;
+    mp_limb_t       c;
+
+    /* as the leaves in bs() */
+    x->p[0] = b;
+    x->np = 1;
+
+    fixed_mul_1(x->p, &x->np, b);
+    fixed_mul_1(x->p, &x->np, b);
+    fixed_mul_1(x->p, &x->np, (C / 24) * (C / 24));
+    fixed_mul_1(x->p, &x->np, C * 24);
+
+    x->g[0] = (2 * b) - 1;
+    x->ng = 1;
+
+    fixed_mul_1(x->g, &x->ng, (6 * b) - 1);
+    fixed_mul_1(x->g, &x->ng, (6 * b) - 5);
+
+    t[0] = b;
+
+    fixed_mul_1(t, &nt, B);
+
+    c = mpn_add_1(t, t, nt, A);
+
+    if (c) {
+        t[nt++] = c;
+    }
+
+    x->nq = fixed_mul(x->q, x->g, x->ng, t, nt);
+    x->sq = (b % 2);
+
+    if (check_level >= 0) {
+        residue_leaf(&x->r, b);
+    }
+
+    progress_bs_node(1);
+}
+
+static void fixed_split(uint64_t a, uint64_t b, uint64_t gflag, fixed_t * x, mp_limb_t * limbs) {
+    fixed_t         l;
+    fixed_t         r;
+    mp_limb_t *     t1;
+    mp_limb_t *     t2;
+    mp_size_t       n1;
+    mp_size_t       n2;
+    uint64_t        mid;
+
+    mid = a + ((b - a) * BS_SPLIT);
+
+    limbs = fixed_place(&l, limbs, mid - a);
+    limbs = fixed_place(&r, limbs, b - mid);
+
+    t1 = limbs;
+    t2 = t1 + FIXED_Q_LIMBS(b - a);
+
+    fixed_bs(a, mid, 1, &l);
+    fixed_bs(mid, b, gflag, &r);
+
+    x->np = fixed_mul(x->p, l.p, l.np, r.p, r.np);
+
+    n1 = fixed_mul(t1, l.q, l.nq, r.p, r.np);
+    n2 = fixed_mul(t2, r.q, r.nq, l.g, l.ng);
+
+    fixed_add(x, t1, n1, l.sq, t2, n2, r.sq);
+
+    if (gflag) {
+        x->ng = fixed_mul(x->g, l.g, l.ng, r.g, r.ng);
+    }
+
+    if (check_level >= 0) {
+        x->r = l.r;
+        residue_merge(&x->r, &r.r, gflag);
+    }
+
+    progress_bs_node(b - a);
+}
+
+/*
+** One function per size class, each with scratch for its children
+** sized at compile time.
+**
+** Skipping fac_remove_gcd() below FIXED_MAX_TERMS leaves those nodes,
+** and so the final P & Q, a little bigger: P at 1M digits is 1456401
+** digits rather than 1455608, at 10M 14562063 rather than 14561191.
+** That's under 0.06%, and the gcd removals it saves cost more than the
+** bigger multiplies above.
+*/
+#define FIXED_CLASS(n)                                                          \
+static void fixed_bs_##n(uint64_t a, uint64_t b, uint64_t gflag, fixed_t * x) { \
+    mp_limb_t       limbs[FIXED_SCRATCH(n)];                                    \
+                                                                                \
+    fixed_split(a, b, gflag, x, limbs);                                         \
+}
+
+FIXED_CLASS(2)
+FIXED_CLASS(4)
+FIXED_CLASS(8)
+FIXED_CLASS(16)
+
+static void fixed_bs(uint64_t a, uint64_t b, uint64_t gflag, fixed_t * x) {
+    uint64_t        n = b - a;
+
+    if (n == 1) {
+        fixed_leaf(b, x);
+    }
+    else if (n <= 2) {
+        fixed_bs_2(a, b, gflag, x);
+    }
+    else if (n <= 4) {
+        fixed_bs_4(a, b, gflag, x);
+    }
+    else if (n <= 8) {
+        fixed_bs_8(a, b, gflag, x);
+    }
+    else {
+        fixed_bs_16(a, b, gflag, x);
+    }
+}
+
+/* z = x, negated if neg */
+static void fixed_get(mpz_t z, const mp_limb_t * x, mp_size_t n, int neg) {
+    mpn_copyi(mpz_limbs_write(z, max(n, 1)), x, n);
+    mpz_limbs_finish(z, neg ? -n : n);
+}
+
+/* the factors of leaf b's p & g */
+static void fac_leaf(fac_t fp, fac_t fg, uint64_t b) {
+    uint64_t        i;
+
+    i = b;
+
+    while ((i & 1) == 0) {
+        i >>= 1;
+    }
+
+    fac_set_bp(fp, i, 3);	/*  b^3 */
+    fac_mul_bp(fp, 3 * 5 * 23 * 29, 3);
+
+    fp[0].pow[0]--;
+
+    fac_set_bp(fg, (2 * b) - 1, 1);	/* 2b-1 */
+    fac_mul_bp(fg, (6 * b) - 1, 1);	/* 6b-1 */
+    fac_mul_bp(fg, (6 * b) - 5, 1);	/* 6b-5 */
+}
+
+/*
+** bs() for a node of up to FIXED_MAX_TERMS terms, the factors are
+** multiplied up from those of the leaves using the next slot of the
+** stack as scratch, the node's children would have used it.
+*/
+static void bs_fixed(uint64_t a, uint64_t b, uint64_t gflag, int64_t level) {
+    mp_limb_t       limbs[FIXED_LIMBS(FIXED_MAX_TERMS)];
+    fixed_t         x;
+    uint64_t        i;
+
+    fixed_place(&x, limbs, FIXED_MAX_TERMS);
+    fixed_bs(a, b, gflag, &x);
+
+    fixed_get(p1, x.p, x.np, 0);
+    fixed_get(q1, x.q, x.nq, x.sq);
+
+    if (gflag) {
+        fixed_get(g1, x.g, x.ng, 0);
+    }
+
+    fac_leaf(fp1, fg1, a + 1);
+
+    for (i = a + 2; i <= b; i++) {
+        fac_leaf(fp2, fg2, i);
+        fac_mul(fp1, fp2);
+
+        if (gflag) {
+            fac_mul(fg1, fg2);
+        }
+    }
+
+    if (lean && b == last_term && bs_threads == 1) {
+        free_sieve();
+    }
+
+    e1 = bs_exact;
+
+    if (check_level >= 0) {
+        r1 = x.r;
+
+        if (level <= check_level) {
+            residue_check(&r1, p1, q1, g1, gflag, a, b, level);
+        }
+    }
+}
+
+/* binary splitting */
+static void bs(uint64_t a, uint64_t b, uint64_t gflag, int64_t level, bs_bits_t prec) {
+    uint64_t      mid;
+    int           ccc;
+    bs_bits_t     left;
+    bs_bits_t     right;
+    int64_t       j;
+
+    if (b - a == 1) {
+        /*
+        ** g(b-1,b) = (6b-5)(2b-1)(6b-1)
+        ** p(b-1,b) = b^3 * C^3 / 24
+        ** q(b-1,b) = (-1)^b*g(b-1,b)*(A+Bb).
+        */
+        mpz_set_ui(p1, b);
+        mpz_mul_ui(p1, p1, b);
+        mpz_mul_ui(p1, p1, b);
+        mpz_mul_ui(p1, p1, (C / 24) * (C / 24));
+        mpz_mul_ui(p1, p1, C * 24);
+
+        mpz_set_ui(g1, (2 * b) - 1);
+        mpz_mul_ui(g1, g1, (6 * b) - 1);
+        mpz_mul_ui(g1, g1, (6 * b) - 5);
+
+        mpz_set_ui(q1, b);
+        mpz_mul_ui(q1, q1, B);
+        mpz_add_ui(q1, q1, A);
+        mpz_mul   (q1, q1, g1);
+
+        if (b % 2) {
+            mpz_neg(q1, q1);
+        }
+
+        fac_leaf(fp1, fg1, b);
+
+        if (check_level >= 0) {
+            residue_leaf(&r1, b);
+        }
+
+        e1 = bs_exact;
+
+        /*
+        ** The last leaf is visited last, after it there are only
+        ** merges left so the sieve can go...
+        */
+        if (lean && b == last_term && bs_threads == 1) {
+            free_sieve();
+        }
+
+        progress_bs_node(1);
+    }
+    else if (b - a <= FIXED_MAX_TERMS && b < FIXED_MAX_B && GMP_NUMB_BITS == 64) {
+        bs_fixed(a, b, gflag, level);
+    }
+    else {
+        /*
+        ** p(a,b) = p(a,m) * p(m,b)
+        ** g(a,b) = g(a,m) * g(m,b)
+        ** q(a,b) = q(a,m) * p(m,b) + q(m,b) * g(a,m)
+        */
+        mid = a + ((b - a) * BS_SPLIT);
+
+        prec_split(prec, a, mid, gflag, &left, &right);
+
+        if (thread_budget > 1 && (b - a) >= PARALLEL_MIN_TERMS) {
+            bs_fork(a, mid, b, gflag, level, left, right);
+        }
+        else {
+            bs(a, mid, 1, level + 1, left);
+
+            top++;
+
+            bs(mid, b, gflag, level + 1, right);
+
+            top--;
+        }
+
+        /* all the leaves are done, whichever thread they ran in */
+        if (level == 0 && lean) {
+            free_sieve();
+        }
+
+        ccc = (level == 0);
+
+        if (ccc) {
+            CHECK_MEMUSAGE;
+        }
+
+        /* the factors only describe p & g while they're exact */
+        if (level >= 4 && e2.p == 0 && e1.g == 0) {           /* tuning parameter */
+            int64_t     t = elapsed_us();
+
+            fac_remove_gcd(p2, fp2, g1, fg1);
+
+            __atomic_add_fetch(&gcd_time, elapsed_us() - t, __ATOMIC_RELAXED);
+
+            if (check_level >= 0 && fmul->num_facs) {
+                residue_remove_gcd(&r2, &r1, gcd);
+            }
+        }
+
+        if (lean && level < LEAN_LEVELS) {
+            /* free what the previous subtrees left on the stack */
+            for (j = top + 2; j < stack_depth; j++) {
+                lean_release(pstack[j]);
+                lean_release(qstack[j]);
+                lean_release(gstack[j]);
+            }
+        }
+
+        if (ccc) {
+            CHECK_MEMUSAGE;
+        }
+
+        if (lean && !gflag) {
+            /*
+            ** On the right hand spine g(a,b) isn't wanted. Fold g(a,m)
+            ** into q(m,b) first so it can go, and leave the products
+            ** that make the biggest results until their inputs can be
+            ** freed straight after...
+            */
+            mpz_release(g2);
+            mpz_mul(q2, q2, g1);
+            mpz_release(g1);
+
+            if (ccc) {
+                CHECK_MEMUSAGE;
+            }
+
+            mpz_mul(q1, q1, p2);
+            e1.q = add_scaled(q1, e1.q + e2.p, q2, e2.q + e1.g);
+            mpz_release(q2);
+
+            if (ccc) {
+                CHECK_MEMUSAGE;
+            }
+
+            mpz_mul(p1, p1, p2);
+            e1.p += e2.p;
+            mpz_release(p2);
+
+            if (ccc) {
+                CHECK_MEMUSAGE;
+            }
+
+            fac_mul(fp1, fp2);
+
+            lean_release_fac(fp2);
+            lean_release_fac(fg2);
+        }
+        else {
+            mpz_mul(p1, p1, p2);
+
+            if (ccc) {
+                CHECK_MEMUSAGE;
+            }
+
+            mpz_mul(q1, q1, p2);
+
+            if (ccc) {
+                CHECK_MEMUSAGE;
+            }
+
+            mpz_mul(q2, q2, g1);
+
+            if (ccc) {
+                CHECK_MEMUSAGE;
+            }
+
+            e1.q = add_scaled(q1, e1.q + e2.p, q2, e2.q + e1.g);
+            e1.p += e2.p;
+
+            if (ccc) {
+                CHECK_MEMUSAGE;
+            }
+
+            fac_mul(fp1, fp2);
+
+            if (gflag) {
+                mpz_mul(g1, g1, g2);
+                fac_mul(fg1, fg2);
+                e1.g += e2.g;
+            }
+
+            if (lean) {
+                lean_release(p2);
+                lean_release(q2);
+                lean_release(g2);
+                lean_release_fac(fp2);
+                lean_release_fac(fg2);
+            }
+        }
+
+        truncate_to(p1, &e1.p, prec.p);
+        truncate_to(q1, &e1.q, prec.q);
+
+        if (gflag) {
+            truncate_to(g1, &e1.g, prec.g);
+        }
+
+        if (check_level >= 0) {
+            residue_merge(&r1, &r2, gflag);
+
+            /* the residues are only good while nothing has been truncated */
+            if (level <= check_level && e1.p == 0 && e1.q == 0 && (!gflag || e1.g == 0)) {
+                residue_check(&r1, p1, q1, g1, gflag, a, b, level);
+            }
+        }
+
+        progress_bs_node(b - a);
+
+        /* the root's dots are the last of the bar */
+        if (level == 0) {
+            puts ("");
+        }
+    }
+
+    if (out & 2) {
+        printf("p(%llu, %llu) = ", a, b);
+        fac_show(fp1);
+
+        if (gflag) {
+            printf("g(%llu, %llu) = ", a ,b);
+            fac_show(fg1);
+        }
+    }
+}
+
+static void build_sieve(long int n, sieve_t *s) {
+    int64_t           m;
+    int64_t           i;
+    int64_t           j;
+    int64_t           k;
+
+    sieve_size = n;
+    m = (int64_t)sqrt(n);
+    memset(s, 0, sizeof(sieve_t) * n / 2);
+
+    s[1 / 2].fac = 1;
+    s[1 / 2].pow = 1;
 
     for (i = 3; i <= n; i += 2) {
         if (s[i/2].fac == 0) {
             s[i/2].fac = i;
             s[i/2].pow = 1;
 
-            if (i <= m) {
-                for (j = i * i, k = i >> 1; j <= n; j += i + i, k++) {
-                    if (s[j/2].fac == 0) {
-                        s[j/2].fac = i;
+            if (i <= m) {
+                for (j = i * i, k = i >> 1; j <= n; j += i + i, k++) {
+                    if (s[j/2].fac == 0) {
+                        s[j/2].fac = i;
+
+                        if (s[k].fac == i) {
+                            s[j/2].pow = s[k].pow + 1;
+                            s[j/2].nxt = s[k].nxt;
+                        }
+                        else {
+                            s[j/2].pow = 1;
+                            s[j/2].nxt = k;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+** -time-budget, the modelled work of a chunk of c terms merged onto
+** n before it, and of the final phases for all n + c of them.
+*/
+static double budget_work(int64_t n, int64_t c, double * final_work) {
+    uint64_t        digits;
+    int             i;
+
+    digits = (uint64_t)((n + c + 1) * DIGITS_PER_ITER);
+
+    *final_work = 0.0;
+
+    for (i = PROGRESS_DIV; i <= PROGRESS_OUTPUT; i++) {
+        *final_work += progress_estimate(i, n + c, digits);
+    }
+
+    return progress_estimate(PROGRESS_BS, c, 0) + progress_merge_estimate(n + c);
+}
+
+/*
+** -time-budget, extend the terms done a chunk at a time. Each chunk
+** runs through bs() one up the stack and is merged into P, Q & G at
+** the bottom, the way bs() merges its halves, which is fine as the
+** merge is associative. Chunks double in size and are halved while the
+** projected time of the chunk and of the final phases after it won't
+** fit before the deadline, at the rate the chunks so far ran at.
+** Returns the number of terms done.
+*/
+static int64_t bs_anytime(int64_t max_terms, int64_t deadline) {
+    int64_t         n = 0;
+    int64_t         c;
+    int64_t         t;
+    int64_t         spent = 0;
+    double          work = 0.0;
+    double          rate = 0.0;
+    double          chunk_work;
+    double          final_work;
+
+    /* p, q & g of no terms at all */
+    mpz_set_ui(p1, 1);
+    mpz_set_ui(q1, 0);
+    mpz_set_ui(g1, 1);
+
+    residue_set(&r1, 1, 0, 1);
+    e1 = bs_exact;
+
+    while (n < max_terms) {
+        c = min(max(n, BUDGET_MIN_TERMS), max_terms - n);
+
+        while (c > 0 && rate > 0.0) {
+            chunk_work = budget_work(n, c, &final_work);
+
+            if (elapsed() + (int64_t)((chunk_work + final_work) / rate * 1000.0 / BUDGET_MARGIN) <= deadline) {
+                break;
+            }
+
+            c = (c >= 2 * BUDGET_MIN_TERMS) ? c / 2 : 0;
+        }
+
+        if (c == 0) {
+            break;
+        }
+
+        t = elapsed_us();
+
+        top++;
+        bs(n, n + c, 1, 1, bs_exact);
+        top--;
+
+        mpz_mul(p1, p1, p2);
+        mpz_mul(q1, q1, p2);
+        mpz_mul(q2, q2, g1);
+        mpz_add(q1, q1, q2);
+        mpz_mul(g1, g1, g2);
+
+        if (check_level >= 0) {
+            residue_merge(&r1, &r2, 1);
+            residue_check(&r1, p1, q1, g1, 1, 0, n + c, 0);
+        }
+
+        spent += elapsed_us() - t;
+
+        work += budget_work(n, c, &final_work);
+        rate = work / ((double)max(spent, 1) / 1000000.0);
+
+        n += c;
+    }
+
+    puts("");
+
+    return n;
+}
+
+/* the depth of the bs() stacks for terms terms */
+static int64_t bs_depth(int64_t terms) {
+    int64_t         depth = 1;
+
+    while ((1L << depth) < terms) {
+        depth++;
+    }
+
+    return depth + 1;
+}
+
+static void printUsage(void) {
+	printf("\n Usage: chudnovsky [OPTIONS]\n\n");
+	printf("  Options:\n");
+	printf("   -h/?                 Print this help\n");
+	printf("   -digits num_digits   Number of pi digits to compute\n");
+	printf("   -f output_file       The output file, - or none for stdout\n");
+	printf("   -lean                Free memory eagerly to reduce peak RSS\n");
+	printf("   -plan                Predict time & peak memory, then exit\n");
+	printf("   -time-budget s       As many digits as fit in s seconds, up to -digits\n");
+	printf("   -check level         Check bs() mod 61-bit primes at levels <= level\n");
+	printf("   -truncate            Truncate bs() results to the precision they need\n");
+	printf("   -threads num_threads Threads for binary splitting, 0 for all CPUs\n");
+	printf("   -progress-fd fd      Report progress as JSON lines to fd\n");
+	printf("   -progress-socket path Report progress to a Unix socket\n");
+	printf("   -progress-interval s Seconds between progress reports (1)\n");
+	printf("   -sysalloc            Use the default GMP memory functions\n");
+	printf("   -hugetlb             Back large numbers with explicit huge pages\n");
+	printf("   -format text|packed  Output as text (default) or packed digits\n");
+	printf("   -extract packed_file Print digits from a packed file and exit\n");
+	printf("   -start position      First digit to output or extract, 0 is the leading 3\n");
+	printf("   -count num_digits    Number of digits to output or extract\n");
+	printf("\n");
+}
+
+/*
+** Print digits [start, start + count) of a packed file to stdout.
+*/
+static int extract_packed(const char * pszPackedFile, uint64_t start, uint64_t count) {
+    pack_reader_t *     reader;
+    char *              buffer;
+    uint64_t            n;
+    int                 error = 0;
+
+    reader = pack_reader_open(pszPackedFile);
+
+    if (reader == NULL) {
+        return -1;
+    }
+
+    if (start >= pack_reader_num_digits(reader)) {
+        fprintf(stderr, "Start digit is past the %llu digits in file\n", (unsigned long long)pack_reader_num_digits(reader));
+
+        pack_reader_close(reader);
+
+        return -1;
+    }
+
+    if (count == 0) {
+        count = pack_reader_num_digits(reader) - start;
+    }
+
+    buffer = malloc(COPY_BUFFER_SIZE);
+
+    while (count > 0 && !error) {
+        n = min(count, COPY_BUFFER_SIZE);
+
+        error = pack_reader_extract(reader, start, n, buffer);
+
+        if (!error) {
+            fwrite(buffer, 1, n, stdout);
+        }
+
+        start += n;
+        count -= n;
+    }
+
+    printf("\n");
+
+    free(buffer);
+    pack_reader_close(reader);
+
+    return error;
+}
+
+/*
+** With no output file, or "-f -", the digits go to what was stdout
+** when we started and everything else is printed to stderr.
+*/
+static int digits_fd = -1;
+
+static int is_stdout(const char * pszOutputFile) {
+    return strcmp(pszOutputFile, "-") == 0;
+}
+
+static FILE * open_output(const char * pszOutputFile) {
+    FILE *          fptrOut;
+
+    if (is_stdout(pszOutputFile)) {
+        fptrOut = fdopen(digits_fd, "w");
+    }
+    else {
+        fptrOut = fopen(pszOutputFile, "wt");
+    }
+
+    if (fptrOut == NULL) {
+        fprintf(stderr, "Could not open output file '%s': %s\n", pszOutputFile, strerror(errno));
+    }
+
+    return fptrOut;
+}
+
+/*
+** Write the significant digits pszDigits ("31415...") to the output
+** file in the requested format.
+*/
+static int write_digits(const char * pszDigits, const char * pszOutputFile, int format) {
+    FILE *              fptrOut;
+    pack_writer_t *     writer;
+    size_t              n;
+    int                 error = 0;
+
+    n = strlen(pszDigits);
+
+    if (format == FORMAT_PACKED) {
+        writer = pack_writer_open(pszOutputFile);
+
+        if (writer == NULL) {
+            return -1;
+        }
+
+        error = pack_writer_put(writer, pszDigits, n);
+
+        if (pack_writer_close(writer)) {
+            error = -1;
+        }
+
+        return error;
+    }
+
+    fptrOut = open_output(pszOutputFile);
+
+    if (fptrOut == NULL) {
+        return -1;
+    }
+
+    fputc(pszDigits[0], fptrOut);
+    fputc('.', fptrOut);
+
+    if (fwrite(pszDigits + 1, 1, n - 1, fptrOut) != n - 1) {
+        fprintf(stderr, "Could not write output file '%s': %s\n", pszOutputFile, strerror(errno));
+        error = -1;
+    }
+
+    fclose(fptrOut);
+
+    return error;
+}
+
+/*
+** Write digits that are already known, either a window of them or
+** all of them rounded, the way the computed digits would be written.
+*/
+static int write_prefix(uint64_t digits, int window, uint64_t start, uint64_t count, const char * pszOutputFile, int format) {
+    char            szDigits[PI_PREFIX_DIGITS + 1];
+    FILE *          fptrOut;
+    int             error = 0;
+
+    if (!window) {
+        pi_prefix_get(szDigits, digits);
+
+        return write_digits(szDigits, pszOutputFile, format);
+    }
+
+    fptrOut = open_output(pszOutputFile);
+
+    if (fptrOut == NULL) {
+        return -1;
+    }
+
+    if (fwrite(pi_prefix + start, 1, count, fptrOut) != count) {
+        fprintf(stderr, "Could not write output file '%s': %s\n", pszOutputFile, strerror(errno));
+        error = -1;
+    }
+
+    fclose(fptrOut);
+
+    return error;
+}
+
+/*
+** Copy the digits of an mpf_out_str() temp file ("0.31415...e1")
+** to the output file in the requested format.
+*/
+static int write_output(FILE * fptrTmp, const char * pszOutputFile, int format) {
+    FILE *              fptrOut = NULL;
+    pack_writer_t *     writer = NULL;
+    char *              buffer;
+    char *              e;
+    size_t              n;
+    int                 error = 0;
+
+    if (format == FORMAT_PACKED) {
+        writer = pack_writer_open(pszOutputFile);
+
+        if (writer == NULL) {
+            return -1;
+        }
+    }
+    else {
+        fptrOut = open_output(pszOutputFile);
+
+        if (fptrOut == NULL) {
+            return -1;
+        }
+
+        fputs("3.", fptrOut);
+    }
+
+    buffer = malloc(COPY_BUFFER_SIZE);
+
+    /*
+    ** Skip the "0." prefix, for text output we've written the
+    ** leading '3' already...
+    */
+    fseek(fptrTmp, (fptrOut != NULL) ? 3 : 2, SEEK_SET);
+
+    while (!error && (n = fread(buffer, 1, COPY_BUFFER_SIZE, fptrTmp)) > 0) {
+        e = memchr(buffer, 'e', n);
+
+        if (e != NULL) {
+            n = e - buffer;
+        }
+
+        if (writer != NULL) {
+            error = pack_writer_put(writer, buffer, n);
+        }
+        else if (fwrite(buffer, 1, n, fptrOut) != n) {
+            fprintf(stderr, "Could not write output file '%s': %s\n", pszOutputFile, strerror(errno));
+            error = -1;
+        }
+
+        if (e != NULL) {
+            break;
+        }
+    }
+
+    free(buffer);
+
+    if (writer != NULL) {
+        if (pack_writer_close(writer)) {
+            error = -1;
+        }
+    }
+    else {
+        fclose(fptrOut);
+    }
+
+    return error;
+}
+
+/*
+** Write digits [start, start + count) of x to the output file without
+** converting the rest. With x = X.2^-t, X the mantissa, the window is
+** floor(X.5^e / 2^(t - e)) mod 10^count for e = start + count - 1,
+** the one branch of the radix conversion that holds it. That costs a
+** multiply and a division by a count digit number, not a conversion
+** of the whole thing.
+*/
+static int write_window(mpf_t x, uint64_t start, uint64_t count, const char * pszOutputFile) {
+    void            (*free_func)(void *, size_t);
+    FILE *          fptrOut;
+    mpz_t           m;
+    mpz_t           w;
+    mpz_t           r;
+    char *          pszDigits;
+    uint64_t        e;
+    int64_t         t;
+    size_t          len;
+    size_t          pad;
+    int             error = 0;
+
+    fptrOut = open_output(pszOutputFile);
+
+    if (fptrOut == NULL) {
+        return -1;
+    }
+
+    e = start + count - 1;
+    t = (int64_t)(x->_mp_size - x->_mp_exp) * GMP_NUMB_BITS - (int64_t)e;
+
+    mpz_roinit_n(m, x->_mp_d, x->_mp_size);
+
+    mpz_init(w);
+    mpz_init(r);
+
+    mpz_ui_pow_ui(w, 5, e);
+    mpz_mul(w, w, m);
+
+    if (t >= 0) {
+        mpz_fdiv_q_2exp(w, w, t);
+    }
+    else {
+        mpz_mul_2exp(w, w, -t);
+    }
+
+    mpz_ui_pow_ui(r, 10, count);
+    mpz_fdiv_r(w, w, r);
+    mpz_clear(r);
+
+    pszDigits = mpz_get_str(NULL, 10, w);
+    mpz_clear(w);
+
+    /* the window may start with zeros */
+    len = strlen(pszDigits);
+
+    for (pad = len; pad < count; pad++) {
+        fputc('0', fptrOut);
+    }
+
+    if (fwrite(pszDigits, 1, len, fptrOut) != len) {
+        fprintf(stderr, "Could not write output file '%s': %s\n", pszOutputFile, strerror(errno));
+        error = -1;
+    }
+
+    mp_get_memory_functions(NULL, NULL, &free_func);
+    free_func(pszDigits, len + 1);
+
+    fclose(fptrOut);
+
+    return error;
+}
+
+/*
+** Streamed output. Digits go to a pipe, socket or other non-regular
+** file as they are converted, rather than after a round trip through
+** the temp file.
+*/
+static int is_stream(const char * pszOutputFile) {
+    struct stat     st;
+
+    if (is_stdout(pszOutputFile)) {
+        return 1;
+    }
+
+    return stat(pszOutputFile, &st) == 0 && !S_ISREG(st.st_mode);
+}
+
+/*
+** Write x, which is less than 10^n, as exactly n digits, the leading
+** chunk as "3.1415..." and, like mpf_out_str(), without the trailing
+** zeros of the last chunk. x is split at 10^(L.2^j), the largest such
+** power below it, and the high part converted first, so the leading
+** chunks are final & streamed while the rest is still being worked on.
+** x is cleared.
+*/
+static int stream_convert(stream_writer_t * w, mpz_t x, uint64_t n, mpz_t * pow10, int lead, int tail, char * leaf) {
+    mpz_t           hi;
+    mpz_t           lo;
+    uint64_t        k;
+    size_t          len;
+    int             j;
+    int             error;
+
+    if (n <= STREAM_LEAF_DIGITS) {
+        mpz_get_str(leaf, 10, x);
+        mpz_clear(x);
+
+        len = strlen(leaf);
+
+        /* the low parts may start with zeros */
+        memmove(leaf + n - len, leaf, len);
+        memset(leaf, '0', n - len);
+
+        if (tail) {
+            while (n > 1 && leaf[n - 1] == '0') {
+                n--;
+            }
+        }
+
+        if (lead) {
+            error = stream_writer_put(w, leaf, 1);
+            error |= stream_writer_put(w, ".", 1);
+            error |= stream_writer_put(w, leaf + 1, n - 1);
+
+            return error;
+        }
+
+        return stream_writer_put(w, leaf, n);
+    }
+
+    for (j = 0; ((uint64_t)STREAM_LEAF_DIGITS << (j + 1)) < n; j++) {
+        ;
+    }
+
+    k = (uint64_t)STREAM_LEAF_DIGITS << j;
+
+    mpz_init(hi);
+    mpz_init(lo);
+
+    mpz_tdiv_qr(hi, lo, x, pow10[j]);
+    mpz_clear(x);
+
+    error = stream_convert(w, hi, n - k, pow10, lead, 0, leaf);
+
+    if (error) {
+        mpz_clear(lo);
+        return error;
+    }
+
+    return stream_convert(w, lo, k, pow10, 0, tail, leaf);
+}
+
+/*
+** Stream the digits of x, rounded to digits significant digits as
+** mpf_out_str() would.
+*/
+static int write_stream(mpf_t x, uint64_t digits, const char * pszOutputFile) {
+    stream_writer_t *   w;
+    mpz_t               pow10[STREAM_MAX_POWERS];
+    mpz_t               m;
+    mpz_t               n;
+    char *              leaf;
+    uint64_t            e;
+    int64_t             t;
+    int                 num_powers;
+    int                 fd;
+    int                 i;
+    int                 error;
+
+    if (is_stdout(pszOutputFile)) {
+        fd = digits_fd;
+    }
+    else {
+        fd = open(pszOutputFile, O_WRONLY);
+
+        if (fd < 0) {
+            fprintf(stderr, "Could not open output file '%s': %s\n", pszOutputFile, strerror(errno));
+            return -1;
+        }
+    }
+
+    w = stream_writer_open(fd);
+
+    if (w == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    /* n = x.10^e rounded, with x = X.2^-t as in write_window() */
+    e = digits - 1;
+    t = (int64_t)(x->_mp_size - x->_mp_exp) * GMP_NUMB_BITS - (int64_t)e;
+
+    mpz_roinit_n(m, x->_mp_d, x->_mp_size);
+
+    mpz_init(n);
+
+    mpz_ui_pow_ui(n, 5, e);
+    mpz_mul(n, n, m);
+
+    if (t > 0) {
+        mpz_tdiv_q_2exp(n, n, t - 1);
+        mpz_add_ui(n, n, 1);
+        mpz_tdiv_q_2exp(n, n, 1);
+    }
+    else {
+        mpz_mul_2exp(n, n, -t);
+    }
+
+    /* 10^(L.2^j) for each split */
+    mpz_init(pow10[0]);
+    mpz_ui_pow_ui(pow10[0], 10, STREAM_LEAF_DIGITS);
+
+    for (num_powers = 1; num_powers < STREAM_MAX_POWERS && ((uint64_t)STREAM_LEAF_DIGITS << num_powers) < digits; num_powers++) {
+        mpz_init(pow10[num_powers]);
+        mpz_mul(pow10[num_powers], pow10[num_powers - 1], pow10[num_powers - 1]);
+    }
+
+    leaf = malloc(STREAM_LEAF_DIGITS + 2);
+
+    error = stream_convert(w, n, digits, pow10, 1, 1, leaf);
+
+    free(leaf);
+
+    for (i = 0; i < num_powers; i++) {
+        mpz_clear(pow10[i]);
+    }
+
+    if (stream_writer_close(w)) {
+        error = -1;
+    }
+
+    return error;
+}
+
+/*
+** Modelled peak memory of each phase in bytes, returns the overall
+** peak.
+*/
+static double plan_memory(uint64_t digits, int threads, int isLean, int window, double * phase_mem) {
+    double          d = (double)digits;
+    double          sieve_bytes;
+    double          peak = 0.0;
+    int             i;
+
+    sieve_bytes = (double)max(3 * 5 * 23 * 29 + 1, (int64_t)(digits / DIGITS_PER_ITER) * 6) / 2 * sizeof(sieve_t);
+
+    phase_mem[PROGRESS_SIEVE] = PLAN_BASE_BYTES + sieve_bytes;
+    phase_mem[PROGRESS_BS] = phase_mem[PROGRESS_SIEVE] + d * (isLean ? PLAN_LEAN_BYTES : PLAN_BS_BYTES);
+    phase_mem[PROGRESS_BS] += d * PLAN_THREAD_BYTES * (threads - 1);
+    phase_mem[PROGRESS_DIV] = PLAN_BASE_BYTES + d * PLAN_FINAL_BYTES;
+    phase_mem[PROGRESS_SQRT] = phase_mem[PROGRESS_DIV];
+    phase_mem[PROGRESS_MUL] = phase_mem[PROGRESS_DIV];
+    phase_mem[PROGRESS_OUTPUT] = PLAN_BASE_BYTES + d * (window ? PLAN_WINDOW_BYTES : PLAN_OUTPUT_BYTES);
+
+    for (i = 0; i < PROGRESS_DONE; i++) {
+        peak = max(peak, phase_mem[i]);
+    }
+
+    return peak;
+}
+
+/* free bytes on the file system holding pszPath */
+static double free_disk(const char * pszPath) {
+    struct statvfs  fs;
+    char            szDir[4096];
+    char *          slash;
+
+    strncpy(szDir, pszPath, sizeof(szDir) - 1);
+    szDir[sizeof(szDir) - 1] = '\0';
+
+    slash = strrchr(szDir, '/');
+
+    if (slash == NULL) {
+        strcpy(szDir, ".");
+    }
+    else if (slash == szDir) {
+        slash[1] = '\0';
+    }
+    else {
+        *slash = '\0';
+    }
+
+    if (statvfs(szDir, &fs) != 0) {
+        return -1.0;
+    }
+
+    return (double)fs.f_bavail * (double)fs.f_frsize;
+}
+
+/*
+** -plan, predict the time and peak memory of each phase and recommend
+** settings that fit this machine, without computing anything. The
+** rate of work is measured by timing a PLAN_SAMPLE_DIGITS digit bs().
+*/
+static int run_plan(uint64_t digits, uint64_t count, int window, int format, const char * pszOutputFile) {
+    static const char * phase_names[] = {
+        "sieve", "bs", "div", "sqrt", "mul", "output"
+    };
+    double          phase_mem[PROGRESS_DONE];
+    double          phase_time[PROGRESS_DONE];
+    double          rate;
+    double          total = 0.0;
+    double          peak;
+    double          avail;
+    double          disk;
+    double          tmp_bytes;
+    double          text_bytes;
+    double          packed_bytes;
+    int64_t         sample_terms;
+    int64_t         t;
+    int             cpus = 0;
+    int             threads;
+    int             useLean;
+    int             i;
+
+    /* time a sample run to calibrate the cost model */
+    sample_terms = PLAN_SAMPLE_DIGITS / DIGITS_PER_ITER;
+
+    t = elapsed_us();
+
+    sieve_size = max(3 * 5 * 23 * 29 + 1, sample_terms * 6);
+    sieve = (sieve_t *)malloc(sizeof(sieve_t) * sieve_size / 2);
+
+    build_sieve(sieve_size, sieve);
+
+    last_term = sample_terms;
+
+    pow_cache_init();
+    bs_thread_init(bs_depth(sample_terms));
+
+    bs(0, sample_terms, 0, 0, bs_exact);
+
+    t = elapsed_us() - t;
+
+    bs_thread_clear();
+    free_sieve();
+
+    printf("sample  time = %6.3f\n", (double)t / 1000000.0);
+
+    progress_init(sample_terms, PLAN_SAMPLE_DIGITS, BS_SPLIT);
+
+    rate = (progress_work(PROGRESS_SIEVE) + progress_work(PROGRESS_BS)) / ((double)t / 1000000.0);
+
+    /* then model the real thing */
+    progress_init(digits / DIGITS_PER_ITER, digits, BS_SPLIT);
+
+    for (i = 0; i < PROGRESS_DONE; i++) {
+        phase_time[i] = progress_work(i) / rate;
+    }
+
+    /* a window costs about a multiply */
+    if (window) {
+        phase_time[PROGRESS_OUTPUT] = phase_time[PROGRESS_MUL];
+    }
+
+    if (bs_threads > 1) {
+        phase_time[PROGRESS_BS] /= bs_threads * PLAN_THREAD_EFFICIENCY;
+    }
+
+    peak = plan_memory(digits, bs_threads, lean, window, phase_mem);
+
+    printf(
+        "plan    digits = %llu, terms = %llu, threads = %d%s\n",
+        (unsigned long long)digits,
+        (unsigned long long)(digits / DIGITS_PER_ITER),
+        bs_threads,
+        lean ? ", lean" : "");
+
+    for (i = 0; i < PROGRESS_DONE; i++) {
+        printf("%-8stime = %9.3f  peak = %10.1f MB\n", phase_names[i], phase_time[i], phase_mem[i] / 1048576.0);
+        total += phase_time[i];
+    }
+
+    printf("total   time = %9.3f  peak = %10.1f MB\n", total, peak / 1048576.0);
+
+    /*
+    ** The most threads that fit in memory, in -lean mode only if they
+    ** wouldn't otherwise...
+    */
+    avail = (double)available_memory() * 1024.0;
 
-                        if (s[k].fac == i) {
-                            s[j/2].pow = s[k].pow + 1;
-                            s[j/2].nxt = s[k].nxt;
-                        }
-                        else {
-                            s[j/2].pow = 1;
-                            s[j/2].nxt = k;
-                        }
-                    }
-                }
+    for (i = 0; i < numa_topo_num_nodes(); i++) {
+        cpus += numa_topo_num_cpus(i);
+    }
+
+    if (digits <= SMALL_DIGITS) {
+        cpus = 1;
+    }
+
+    for (threads = cpus; threads > 0; threads--) {
+        for (useLean = 0; useLean < 2; useLean++) {
+            if (plan_memory(digits, threads, useLean, window, phase_mem) <= avail) {
+                break;
             }
         }
+
+        if (useLean < 2) {
+            break;
+        }
     }
-}
 
-static void printUsage(void) {
-	printf("\n Usage: chudnovsky [OPTIONS]\n\n");
-	printf("  Options:\n");
-	printf("   -h/?                 Print this help\n");
-	printf("   -digits num_digits   Number of pi digits to compute\n");
-	printf("   -f output_file       The output file\n");
-	printf("\n");
+    printf("memory  available = %.1f MB\n", avail / 1048576.0);
+
+    /* mpf_out_str() writes all the digits to a temp file first */
+    tmp_bytes = window ? 0.0 : (double)digits;
+    text_bytes = window ? (double)count : (double)digits;
+    packed_bytes = text_bytes * PLAN_PACKED_RATIO;
+
+    disk = is_stdout(pszOutputFile) ? free_disk("./") : free_disk(pszOutputFile);
+
+    if (disk >= 0.0) {
+        printf(
+            "disk    free = %.1f MB, text needs %.1f MB, packed %.1f MB\n",
+            disk / 1048576.0,
+            (tmp_bytes + text_bytes) / 1048576.0,
+            (tmp_bytes + packed_bytes) / 1048576.0);
+    }
+
+    if (threads == 0) {
+        printf("recommend: none, %llu digits will not fit in memory\n", (unsigned long long)digits);
+        return -1;
+    }
+
+    printf("recommend: -threads %d%s", threads, useLean ? " -lean" : "");
+
+    if (window || is_stdout(pszOutputFile)) {
+        printf("\n");
+    }
+    else if (digits >= PLAN_PACKED_DIGITS || (disk >= 0.0 && tmp_bytes + text_bytes > disk)) {
+        printf(" -format packed\n");
+    }
+    else {
+        printf(" -format text\n");
+    }
+
+    if (disk >= 0.0 && tmp_bytes + packed_bytes > disk) {
+        printf("warning: not enough disk for the output\n");
+    }
+
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
     char *          endptr;
-    char *          pszOutputFile;
+    char *          pszOutputFile = NULL;
+    char *          pszPackedFile = NULL;
     char            szTmpFile[32];
 	uint64_t        digits = DEFAULT_DIGITS;
-    FILE *          fptrOut;
+    uint64_t        start = 0;
+    uint64_t        count = 0;
+    int             window = 0;
+    int             useTmpFile = 0;
+    int             stream = 0;
+    int             plan = 0;
+    int             small;
+    double          timeBudget = 0.0;
+    int             truncateTop = 0;
+    bs_bits_t       prec = bs_exact;
     FILE *          fptrTmp;
+    char *          pszDigits;
+    mp_exp_t        exp;
+    void            (*free_func)(void *, size_t);
     mpf_t           pi;
     mpf_t           qi;
+    mpz_t           pz;
+    mpz_t           qz;
     int64_t         i;
-    int64_t         depth = 1;
+    int64_t         depth;
     int64_t         terms;
     uint64_t        psize;
     uint64_t        qsize;
@@ -705,7 +2757,12 @@ int main(int argc, char *argv[]) {
     int64_t         end;
     int             error = 0;
     int             tmpFd;
-    int             ch;
+    int             format = FORMAT_TEXT;
+    int             allocFlags = 0;
+    int             progressFd = -1;
+    char *          pszProgressSocket = NULL;
+    double          progressInterval = 1.0;
+    int             useGmpAlloc = 1;
 
     prog_name = argv[0];
 
@@ -718,6 +2775,99 @@ int main(int argc, char *argv[]) {
                     if (*endptr != '\0') { 
                         printUsage();
                         return -1;
+                    }
+				}
+				else if (strcmp(&argv[i][1], "format") == 0) {
+                    i++;
+
+                    if (strcmp(&argv[i][0], "packed") == 0) {
+                        format = FORMAT_PACKED;
+                    }
+                    else if (strcmp(&argv[i][0], "text") == 0) {
+                        format = FORMAT_TEXT;
+                    }
+                    else {
+                        printUsage();
+                        return -1;
+                    }
+				}
+				else if (strcmp(&argv[i][1], "lean") == 0) {
+                    lean = 1;
+				}
+				else if (strcmp(&argv[i][1], "threads") == 0) {
+                    bs_threads = (int)strtol(&argv[++i][0], &endptr, 10);
+
+                    if (*endptr != '\0' || bs_threads < 0) {
+                        printUsage();
+                        return -1;
+                    }
+				}
+				else if (strcmp(&argv[i][1], "progress-fd") == 0) {
+                    progressFd = (int)strtol(&argv[++i][0], &endptr, 10);
+
+                    if (*endptr != '\0' || progressFd < 0) {
+                        printUsage();
+                        return -1;
+                    }
+				}
+				else if (strcmp(&argv[i][1], "progress-socket") == 0) {
+					pszProgressSocket = strdup(&argv[++i][0]);
+				}
+				else if (strcmp(&argv[i][1], "progress-interval") == 0) {
+                    progressInterval = strtod(&argv[++i][0], &endptr);
+
+                    if (*endptr != '\0' || progressInterval <= 0.0) {
+                        printUsage();
+                        return -1;
+                    }
+				}
+				else if (strcmp(&argv[i][1], "plan") == 0) {
+                    plan = 1;
+				}
+				else if (strcmp(&argv[i][1], "check") == 0) {
+                    check_level = (int)strtol(&argv[++i][0], &endptr, 10);
+
+                    if (*endptr != '\0' || check_level < 0) {
+                        printUsage();
+                        return -1;
+                    }
+				}
+				else if (strcmp(&argv[i][1], "truncate") == 0) {
+                    truncateTop = 1;
+				}
+				else if (strcmp(&argv[i][1], "time-budget") == 0) {
+                    timeBudget = strtod(&argv[++i][0], &endptr);
+
+                    if (*endptr != '\0' || timeBudget <= 0.0) {
+                        printUsage();
+                        return -1;
+                    }
+				}
+				else if (strcmp(&argv[i][1], "sysalloc") == 0) {
+                    useGmpAlloc = 0;
+				}
+				else if (strcmp(&argv[i][1], "hugetlb") == 0) {
+                    allocFlags |= GMP_ALLOC_HUGETLB;
+				}
+				else if (strcmp(&argv[i][1], "extract") == 0) {
+					pszPackedFile = strdup(&argv[++i][0]);
+				}
+				else if (strcmp(&argv[i][1], "start") == 0) {
+                    start = strtoull(&argv[++i][0], &endptr, 10);
+                    window = 1;
+
+                    if (*endptr != '\0') {
+                        printUsage();
+                        return -1;
+                    }
+				}
+				else if (strcmp(&argv[i][1], "count") == 0) {
+                    count = strtoull(&argv[++i][0], &endptr, 10);
+                    window = 1;
+
+                    if (*endptr != '\0') {
+                        printUsage();
+                        return -1;
                     }
 				}
 				else if (strncmp(&argv[i][1], "f", 1) == 0) {
@@ -740,106 +2890,214 @@ int main(int argc, char *argv[]) {
         return -1;
 	}
 
-	if (digits < 1) { 
+    if (pszPackedFile != NULL) {
+        return extract_packed(pszPackedFile, start, count);
+    }
+
+	if (digits < 1) {
         printUsage();
         return -1;
     }
 
-    terms = digits / DIGITS_PER_ITER;
+    if (pszOutputFile == NULL) {
+        pszOutputFile = "-";
+    }
 
-    while ((1L << depth) < terms) {
-        depth++;
+    /* packed output needs a file to seek in */
+    if (is_stdout(pszOutputFile) && format != FORMAT_TEXT) {
+        printUsage();
+        return -1;
     }
 
-    depth++;
-    
-    percent = (double)terms / 100.0;
+    /* a window has to lie within the digits computed */
+    if (window) {
+        if (start >= digits || count > digits - start || format != FORMAT_TEXT || timeBudget > 0.0) {
+            printUsage();
+            return -1;
+        }
+
+        if (count == 0) {
+            count = digits - start;
+        }
+    }
+
+    /* a budget run's terms are merged exactly, chunk by chunk */
+    if (timeBudget > 0.0 && truncateTop) {
+        printUsage();
+        return -1;
+    }
+
+    /* truncated nodes have no exact residues to check */
+    if (check_level >= 0 && truncateTop) {
+        printUsage();
+        return -1;
+    }
+
+    /*
+    ** Keep stdout for the digits, everything else we print goes to
+    ** stderr...
+    */
+    if (is_stdout(pszOutputFile) && !plan) {
+        fflush(stdout);
+
+        digits_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    /* a pipe or socket gets the digits as they are converted */
+    if (format == FORMAT_TEXT && !window && digits > SMALL_DIGITS && is_stream(pszOutputFile)) {
+        stream = 1;
+    }
+
+    if (digits <= PI_PREFIX_DIGITS && !plan) {
+        return write_prefix(digits, window, start, count, pszOutputFile, format);
+    }
+
+    /*
+    ** Small runs are over before a thread would get going, or the
+    ** allocator, topology scan & progress reporter would pay off...
+    */
+    small = (digits <= SMALL_DIGITS && !plan);
+
+    if (small) {
+        bs_threads = 1;
+    }
+    else {
+        if (useGmpAlloc) {
+            gmp_alloc_install(allocFlags);
+        }
 
+        numa_topo_init();
+    }
+
+    if (bs_threads == 0) {
+        for (i = 0; i < numa_topo_num_nodes(); i++) {
+            bs_threads += numa_topo_num_cpus(i);
+        }
+    }
+
+    if (plan) {
+        return run_plan(digits, count, window, format, pszOutputFile);
+    }
+
+    terms = digits / DIGITS_PER_ITER;
+    depth = bs_depth(terms);
+    
     printf("#terms=%lld, depth=%lld\n", terms, depth);
 
-    begin = cputime();
+    if (pszProgressSocket != NULL) {
+        if (progress_open_socket(pszProgressSocket)) {
+            return -1;
+        }
+    }
+    else if (progressFd >= 0) {
+        progress_open_fd(progressFd);
+    }
+
+    /* the model is cheap & the time budget needs it */
+    progress_init(terms, digits, BS_SPLIT);
+
+    /* small runs still report each phase, just not every interval */
+    if (!small) {
+        progress_start(progressInterval);
+    }
+
+    begin = elapsed();
 
     printf("sieve   ");
     fflush(stdout);
 
     sieve_size = max(3 * 5 * 23 * 29 + 1, terms * 6);
-    sieve = (sieve_t *)malloc(sizeof(sieve_t) * sieve_size / 2);
+
+    if (sieve_size <= SMALL_SIEVE_SIZE) {
+        sieve = small_sieve;
+    }
+    else {
+        sieve = (sieve_t *)malloc(sizeof(sieve_t) * sieve_size / 2);
+    }
 
     build_sieve(sieve_size, sieve);
 
-    mid0 = cputime();
+    mid0 = elapsed();
     
     printf("time = %6.3f\n", (double)(mid0 - begin) / 1000.0);
 
     /* allocate stacks */
-    pstack =    malloc(sizeof(mpz_t) * depth);
-    qstack =    malloc(sizeof(mpz_t) * depth);
-    gstack =    malloc(sizeof(mpz_t) * depth);
-    fpstack =   malloc(sizeof(fac_t) * depth);
-    fgstack =   malloc(sizeof(fac_t) * depth);
+    last_term = terms;
 
-    for (i = 0; i < depth; i++) {
-        mpz_init(pstack[i]);
-        mpz_init(qstack[i]);
-        mpz_init(gstack[i]);
+    pow_cache_init();
 
-        fac_init(fpstack[i]);
-        fac_init(fgstack[i]);
-    }
+    /* a -time-budget chunk can be all the terms, one up the stack */
+    bs_thread_init(timeBudget > 0.0 ? depth + 1 : depth);
 
-    mpz_init(gcd);
-    
-    #if HAVE_DIVEXACT_PREINV
-    mpz_init(mgcd);
-    #endif
-    
-    fac_init(ftmp);
-    fac_init(fmul);
+    if (bs_threads > 1) {
+        printf("threads = %d, nodes = %d\n", bs_threads, numa_topo_num_nodes());
+
+        thread_budget = bs_threads;
+        node_lo = 0;
+        node_hi = numa_topo_num_nodes() - 1;
+
+        numa_topo_bind_thread(node_lo);
+
+        if (numa_topo_num_nodes() > 1) {
+            gmp_alloc_set_node(numa_topo_node_id(node_lo));
+        }
+    }
 
     /* begin binary splitting process */
-    if (terms <= 0) {
-        mpz_set_ui(p2, 1);
-        mpz_set_ui(q2, 0);
-        mpz_set_ui(g2, 1);
+    progress_phase(PROGRESS_BS);
+
+    if (timeBudget > 0.0) {
+        terms = bs_anytime(terms, begin + (int64_t)(timeBudget * 1000.0));
+
+        /* the most digits that many terms are good for */
+        digits = min(digits, (uint64_t)((terms + 1) * DIGITS_PER_ITER) - 1);
+
+        printf("budget  terms = %lld, digits = %llu\n", (long long)terms, (unsigned long long)digits);
+    }
+    else if (terms <= 0) {
+        mpz_set_ui(p1, 1);
+        mpz_set_ui(q1, 0);
+        mpz_set_ui(g1, 1);
     }
     else {
-        bs(0, terms, 0, 0);
+        if (truncateTop) {
+            /* p & q to the precision of the division, g isn't wanted */
+            prec.p = (int64_t)((digits * BITS_PER_DIGIT) + 16);
+            prec.q = prec.p;
+        }
+
+        bs(0, terms, 0, 0, prec);
+
+        /* the result is p/q, give them the same exponent & drop it */
+        if (e1.p > e1.q) {
+            mpz_tdiv_q_2exp(q1, q1, e1.p - e1.q);
+        }
+        else if (e1.q > e1.p) {
+            mpz_tdiv_q_2exp(p1, p1, e1.q - e1.p);
+        }
     }
 
-    mid1 = cputime();
+    mid1 = elapsed();
 
     printf("\n");
     printf("bs      time = %6.3f\n", (double)(mid1 - mid0) / 1000.0);
-    printf("gcd     time = %6.3f\n", (double)(gcd_time) / 1000.0);
-
-    /* free some resources */
-    free(sieve);
-
-    #if HAVE_DIVEXACT_PREINV
-    mpz_clear(mgcd);
-    #endif
-
-    mpz_clear(gcd);
-    fac_clear(ftmp);
-    fac_clear(fmul);
-
-    for (i = 1; i < depth; i++) {
-        mpz_clear(pstack[i]);
-        mpz_clear(qstack[i]);
-        mpz_clear(gstack[i]);
+    printf("gcd     time = %6.3f\n", (double)(gcd_time) / 1000000.0);
 
-        fac_clear(fpstack[i]);
-        fac_clear(fgstack[i]);
+    if (check_level >= 0) {
+        printf("check   time = %6.3f\n", (double)(check_time) / 1000000.0);
     }
 
-    mpz_clear(gstack[0]);
+    /* free some resources */
+    free_sieve();
+
+    mpz_init(pz);
+    mpz_init(qz);
 
-    fac_clear(fpstack[0]);
-    fac_clear(fgstack[0]);
+    mpz_swap(pz, p1);
+    mpz_swap(qz, q1);
 
-    free(gstack);
-    free(fpstack);
-    free(fgstack);
+    bs_thread_clear();
 
     /* prepare to convert integers to floats */
     mpf_set_default_prec((int64_t)((digits * BITS_PER_DIGIT) + 16));
@@ -850,56 +3108,58 @@ int main(int argc, char *argv[]) {
         (q+A*p)
     */
 
-    psize = mpz_sizeinbase(p1, 10);
-    qsize = mpz_sizeinbase(q1, 10);
-
-    mpz_addmul_ui(q1, p1, A);
-    mpz_mul_ui(p1, p1, C / D);
+    psize = mpz_sizeinbase(pz, 10);
+    qsize = mpz_sizeinbase(qz, 10);
 
-    mpf_init(pi);
-    mpf_set_z(pi, p1);
-    mpz_clear(p1);
+    mpz_addmul_ui(qz, pz, A);
+    mpz_mul_ui(pz, pz, C / D);
 
-    mpf_init(qi);
-    mpf_set_z(qi, q1);
-    mpz_clear(q1);
+    mpf_init_move_z(pi, pz);
+    mpz_clear(pz);
 
-    free(pstack);
-    free(qstack);
+    mpf_init_move_z(qi, qz);
+    mpz_clear(qz);
 
-    mid2 = cputime();
+    mid2 = elapsed();
 
     /* initialize temp float variables for sqrt & div */
     mpf_init(t1);
     mpf_init(t2);
 
     /* final step */
+    progress_phase(PROGRESS_DIV);
+
     printf("div     ");
     fflush(stdout);
     
     my_div(qi, pi, qi);
     
-    mid3 = cputime();
+    mid3 = elapsed();
     
     printf("time = %6.3f\n", (double)(mid3 - mid2) / 1000.0);
 
+    progress_phase(PROGRESS_SQRT);
+
     printf("sqrt    ");
     fflush(stdout);
     
     my_sqrt_ui(pi, C);
     
-    mid4 = cputime();
+    mid4 = elapsed();
     printf("time = %6.3f\n", (double)(mid4 - mid3) / 1000.0);
 
+    progress_phase(PROGRESS_MUL);
+
     printf("mul     ");
     fflush(stdout);
     
     mpf_mul(qi, qi, pi);
     
-    end = cputime();
+    end = elapsed();
     printf("time = %6.3f\n", (double)(end - mid4) / 1000.0f);
 
     printf("total   time = %6.3f\n", (double)(end - begin) / 1000.0f);
+    printf("cpu     time = %6.3f\n", (double)cputime() / 1000.0f);
     fflush(stdout);
 
     printf(
@@ -909,41 +3169,82 @@ int main(int argc, char *argv[]) {
         qsize, 
         (double)qsize / (double)digits);
 
-    strcpy(szTmpFile, "./pi_temp_XXXXXX");
+    if (window) {
+        printf("pi[%llu..%llu]\n", (unsigned long long)start, (unsigned long long)(start + count - 1));
 
-    /*
-    ** Create and open a temporary file...
-    */
-    tmpFd = mkstemp(szTmpFile);
+        progress_phase(PROGRESS_OUTPUT);
 
-    if (tmpFd < 0) {
-        fprintf(stderr, "Could not create & open temporary file: %s\n", strerror(errno));
-        return -1;
+        error = write_window(qi, start, count, pszOutputFile);
     }
+    else if (stream) {
+        printf("pi[0..%lld]\n", (long long)terms);
 
-    fptrTmp = fdopen(tmpFd, "w");
+        progress_phase(PROGRESS_OUTPUT);
 
-    if (fptrTmp != NULL) {
-        /* output Pi and timing statistics */
-        printf("pi[0..%lld]\n", terms);
-        mpf_out_str(fptrTmp, 10, digits, qi);
-        fclose(fptrTmp);
+        error = write_stream(qi, digits, pszOutputFile);
+    }
+    else if (digits <= SMALL_DIGITS) {
+        /* small enough to convert in memory */
+        printf("pi[0..%lld]\n", (long long)terms);
+
+        progress_phase(PROGRESS_OUTPUT);
+
+        pszDigits = mpf_get_str(NULL, &exp, 10, digits, qi);
 
-        error = 0;
+        error = write_digits(pszDigits, pszOutputFile, format);
+
+        mp_get_memory_functions(NULL, NULL, &free_func);
+        free_func(pszDigits, strlen(pszDigits) + 1);
     }
     else {
-        fprintf(stderr, "Could not open temporary file for writing: %s\n", strerror(errno));
-        error = -1;
+        useTmpFile = 1;
+
+        strcpy(szTmpFile, "./pi_temp_XXXXXX");
+
+        /*
+        ** Create and open a temporary file...
+        */
+        tmpFd = mkstemp(szTmpFile);
+
+        if (tmpFd < 0) {
+            fprintf(stderr, "Could not create & open temporary file: %s\n", strerror(errno));
+            return -1;
+        }
+
+        fptrTmp = fdopen(tmpFd, "w");
+
+        if (fptrTmp != NULL) {
+            /* output Pi and timing statistics */
+            printf("pi[0..%lld]\n", terms);
+
+            progress_phase(PROGRESS_OUTPUT);
+
+            mpf_out_str(fptrTmp, 10, digits, qi);
+            fclose(fptrTmp);
+
+            error = 0;
+        }
+        else {
+            fprintf(stderr, "Could not open temporary file for writing: %s\n", strerror(errno));
+            error = -1;
+        }
     }
 
     /* free float resources */
     mpf_clear(pi);
     mpf_clear(qi);
 
+    /*
+    ** my_sqrt_ui() & my_div() leave t1 & t2 with a different raw
+    ** precision, it has to be put back before they are freed...
+    */
+    mpf_set_prec_raw(t1, mpf_get_default_prec());
+    mpf_set_prec_raw(t2, mpf_get_default_prec());
+
     mpf_clear(t1);
     mpf_clear(t2);
 
-    if (error == 0) {
+    if (error == 0 && useTmpFile) {
         fptrTmp = fopen(szTmpFile, "rt");
 
         if (fptrTmp == NULL) {
@@ -951,29 +3252,8 @@ int main(int argc, char *argv[]) {
             return -1;
         }
 
-        fptrOut = fopen(pszOutputFile, "wt");
-
-        if (fptrOut == NULL) {
-            fprintf(stderr, "Could not open output file '%s': %s\n", pszOutputFile, strerror(errno));
-            fclose(fptrTmp);
-            return -1;
-        }
-
-        fputs("3.", fptrOut);
-
-        fseek(fptrTmp, 3, SEEK_SET);
-
-        while (!feof(fptrTmp)) {
-            ch = fgetc(fptrTmp);
+        error = write_output(fptrTmp, pszOutputFile, format);
 
-            if (ch == 'e') {
-                break;
-            }
-
-            fputc(ch, fptrOut);
-        }
-
-        fclose(fptrOut);
         fclose(fptrTmp);
 
         /*
@@ -982,5 +3262,10 @@ int main(int argc, char *argv[]) {
         unlink(szTmpFile);
     }
 
+    progress_stop();
+
+    printf("out     time = %6.3f\n", (double)(elapsed() - end) / 1000.0);
+    printf("peak    RSS  = %llu KB\n", (unsigned long long)peak_rss());
+
     return error;
 }
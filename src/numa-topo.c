@@ -0,0 +1,197 @@
+/*
+** NUMA topology, see numa-topo.h.
+**
+** Nodes are referred to by index, 0 to numa_topo_num_nodes() - 1, in
+** order of their sysfs node id. The ids needn't be contiguous.
+*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined (__linux__)
+#include <sched.h>
+#endif
+
+#include "numa-topo.h"
+
+#define SYSFS_NODE_PATH     "/sys/devices/system/node"
+
+typedef struct {
+    int             id;
+    int             num_cpus;
+#if defined (__linux__)
+    cpu_set_t       cpus;
+#endif
+}
+numa_node_t;
+
+static numa_node_t      nodes[NUMA_MAX_NODES];
+static int              num_nodes = 0;
+
+/*
+** Parse a sysfs list such as "0-3,8-11" calling fn for each number.
+*/
+static int parse_list(const char * list, void (* fn)(int, void *), void * arg) {
+    const char *    p = list;
+    char *          endptr;
+    long            first;
+    long            last;
+    long            i;
+    int             n = 0;
+
+    while (*p != '\0' && *p != '\n') {
+        first = strtol(p, &endptr, 10);
+
+        if (endptr == p) {
+            return -1;
+        }
+
+        last = first;
+        p = endptr;
+
+        if (*p == '-') {
+            last = strtol(p + 1, &endptr, 10);
+
+            if (endptr == p + 1) {
+                return -1;
+            }
+
+            p = endptr;
+        }
+
+        for (i = first; i <= last; i++) {
+            fn((int)i, arg);
+            n++;
+        }
+
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    return n;
+}
+
+static int read_list(const char * pszPath, char * buffer, size_t size) {
+    FILE *          fptr;
+
+    fptr = fopen(pszPath, "rt");
+
+    if (fptr == NULL) {
+        return -1;
+    }
+
+    if (fgets(buffer, (int)size, fptr) == NULL) {
+        fclose(fptr);
+        return -1;
+    }
+
+    fclose(fptr);
+
+    return 0;
+}
+
+static void add_node(int id, void * arg) {
+    if (num_nodes < NUMA_MAX_NODES) {
+        nodes[num_nodes].id = id;
+        nodes[num_nodes].num_cpus = 0;
+
+#if defined (__linux__)
+        CPU_ZERO(&nodes[num_nodes].cpus);
+#endif
+
+        num_nodes++;
+    }
+}
+
+static void add_cpu(int cpu, void * arg) {
+    numa_node_t *   node = arg;
+
+#if defined (__linux__)
+    if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &node->cpus);
+    }
+#endif
+
+    node->num_cpus++;
+}
+
+static void single_node(void) {
+    long            cpus;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    num_nodes = 1;
+    nodes[0].id = 0;
+    nodes[0].num_cpus = cpus > 0 ? (int)cpus : 1;
+
+#if defined (__linux__)
+    /* an empty set means don't pin */
+    CPU_ZERO(&nodes[0].cpus);
+#endif
+}
+
+/*
+** Read the topology, returns the number of nodes.
+*/
+int numa_topo_init(void) {
+    char            szPath[256];
+    char            szList[4096];
+    int             i;
+
+    num_nodes = 0;
+
+    if (read_list(SYSFS_NODE_PATH "/online", szList, sizeof(szList)) == 0) {
+        parse_list(szList, add_node, NULL);
+    }
+
+    for (i = 0; i < num_nodes; i++) {
+        snprintf(szPath, sizeof(szPath), SYSFS_NODE_PATH "/node%d/cpulist", nodes[i].id);
+
+        if (read_list(szPath, szList, sizeof(szList)) == 0) {
+            parse_list(szList, add_cpu, &nodes[i]);
+        }
+
+        /* memory-only nodes can't run workers */
+        if (nodes[i].num_cpus == 0) {
+            memmove(&nodes[i], &nodes[i + 1], sizeof(numa_node_t) * (num_nodes - i - 1));
+            num_nodes--;
+            i--;
+        }
+    }
+
+    if (num_nodes <= 1) {
+        single_node();
+    }
+
+    return num_nodes;
+}
+
+int numa_topo_num_nodes(void) {
+    return num_nodes;
+}
+
+int numa_topo_node_id(int index) {
+    return nodes[index].id;
+}
+
+int numa_topo_num_cpus(int index) {
+    return nodes[index].num_cpus;
+}
+
+/*
+** Pin the calling thread to the CPUs of node index, a no-op on a
+** single node system.
+*/
+int numa_topo_bind_thread(int index) {
+#if defined (__linux__)
+    if (num_nodes > 1 && CPU_COUNT(&nodes[index].cpus) > 0) {
+        return sched_setaffinity(0, sizeof(cpu_set_t), &nodes[index].cpus);
+    }
+#endif
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+/*
+** NUMA topology, read from /sys/devices/system/node on Linux. On other
+** systems, or if sysfs isn't there, everything is one node holding
+** all the online CPUs.
+*/
+#ifndef __INCL_NUMA_TOPO
+#define __INCL_NUMA_TOPO
+
+#define NUMA_MAX_NODES      64
+
+int         numa_topo_init(void);
+int         numa_topo_num_nodes(void);
+int         numa_topo_node_id(int index);
+int         numa_topo_num_cpus(int index);
+int         numa_topo_bind_thread(int index);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+** The leading digits of pi, see pi-prefix.h.
+*/
+#include <stdint.h>
+#include <string.h>
+
+#include "pi-prefix.h"
+
+const char pi_prefix[] =
+    "3141592653589793238462643383279502884197169399375105820974944592"
+    "3078164062862089986280348253421170679821480865132823066470938446"
+    "0955058223172535940812848111745028410270193852110555964462294895"
+    "4930381964428810975665933446128475648233786783165271201909145648"
+    "5669234603486104543266482133936072602491412737245870066063155881"
+    "7488152092096282925409171536436789259036001133053054882046652138"
+    "4146951941511609433057270365759591953092186117381932611793105118"
+    "5480744623799627495673518857527248912279381830119491298336733624"
+    "4065664308602139494639522473719070217986094370277053921717629317"
+    "6752384674818467669405132000568127145263560827785771342757789609"
+    "1736371787214684409012249534301465495853710507922796892589235420"
+    "1995611212902196086403441815981362977477130996051870721134999999"
+    "8372978049951059731732816096318595024459455346908302642522308253"
+    "3446850352619311881710100031378387528865875332083814206171776691"
+    "4730359825349042875546873115956286388235378759375195778185778053"
+    "2171226806613001927876611195909216420198938095257201065485863278"
+    "8";
+
+/*
+** Copy the first digits digits of pi to pszDigits, rounded to nearest
+** and without trailing zeros, the way mpf_get_str() would. pszDigits
+** must have room for digits + 1 chars, returns the number of digits.
+*/
+uint64_t pi_prefix_get(char * pszDigits, uint64_t digits) {
+    uint64_t        n;
+
+    memcpy(pszDigits, pi_prefix, digits);
+
+    n = digits;
+
+    /* pi is irrational, there are no ties to worry about */
+    if (pi_prefix[digits] >= '5') {
+        while (n > 0 && pszDigits[n - 1] == '9') {
+            n--;
+        }
+
+        /* the leading 3 can't carry out */
+        pszDigits[n - 1]++;
+    }
+
+    while (n > 1 && pszDigits[n - 1] == '0') {
+        n--;
+    }
+
+    pszDigits[n] = '\0';
+
+    return n;
+}
@@ -0,0 +1,17 @@
+/*
+** The leading digits of pi, for runs too small to be worth computing.
+** pi_prefix holds PI_PREFIX_DIGITS digits and a few guard digits for
+** rounding, starting with the leading 3.
+*/
+#ifndef __INCL_PI_PREFIX
+#define __INCL_PI_PREFIX
+
+#include <stdint.h>
+
+#define PI_PREFIX_DIGITS        1000
+
+extern const char       pi_prefix[];
+
+uint64_t    pi_prefix_get(char * pszDigits, uint64_t digits);
+
+#endif
@@ -0,0 +1,531 @@
+/*
+** Progress reporting, see progress.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "progress.h"
+
+/*
+** Cost model, in units of x.log2(x) for an x bit multiply. P, Q & G
+** for k terms are around BITS_PER_TERM * k bits, a merge does four
+** multiplies of its halves. The final phases are multiples of a full
+** precision multiply, the output conversion a multiply per level of
+** the radix conversion. The constants are from timing runs of 1M to
+** 30M digits.
+*/
+#define BITS_PER_TERM       68.6
+#define BITS_PER_DIGIT      3.32192809488736234787
+#define LEAF_COST           400.0
+#define SIEVE_COST          2.0
+#define DIV_COST            4.6
+#define SQRT_COST           2.2
+#define MUL_COST            1.4
+#define OUTPUT_COST         0.57
+
+#define NUM_DOTS            50
+
+#define max(x,y) ((x) > (y) ? (x) : (y))
+#define MODEL_CACHE_SIZE    1021
+
+typedef struct {
+    uint64_t        k;
+    double          cost;
+}
+model_entry_t;
+
+static const char *     phase_names[] = {
+    "sieve",
+    "bs",
+    "div",
+    "sqrt",
+    "mul",
+    "output",
+    "done"
+};
+
+static int                  report_fd = -1;
+static int64_t              interval_ms = 1000;
+static int                  running = 0;
+static pthread_t            reporter;
+static pthread_mutex_t      lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       wakeup = PTHREAD_COND_INITIALIZER;
+
+static uint64_t             num_terms;
+static double               split_ratio;
+static double               phase_work[PROGRESS_DONE];
+static double               total_work;
+static int                  phase = PROGRESS_SIEVE;
+static int64_t              start_ms;
+static int64_t              phase_start_ms;
+static int64_t              bs_start_ms;
+static int64_t              bs_ms;
+
+static uint64_t             bs_done = 0;
+static uint64_t             bs_leaves = 0;
+static int                  dots = 0;
+
+static model_entry_t        model_cache[MODEL_CACHE_SIZE];
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static double mul_cost(double bits) {
+    return bits * log2(bits + 2.0);
+}
+
+static double node_cost(uint64_t k) {
+    if (k <= 1) {
+        return LEAF_COST;
+    }
+
+    return 4.0 * mul_cost((double)k * BITS_PER_TERM / 2.0);
+}
+
+/*
+** Cost of bs() over k terms. The nodes at any one level only differ
+** in size by a term or so, a small cache makes this quick.
+*/
+static double model_bs(uint64_t k) {
+    model_entry_t * e;
+    uint64_t        left;
+    double          cost;
+
+    if (k <= 1) {
+        return node_cost(k);
+    }
+
+    e = &model_cache[k % MODEL_CACHE_SIZE];
+
+    if (e->k == k) {
+        return e->cost;
+    }
+
+    left = (uint64_t)(k * split_ratio);
+    cost = model_bs(left) + model_bs(k - left) + node_cost(k);
+
+    e->k = k;
+    e->cost = cost;
+
+    return cost;
+}
+
+/*
+** Peak resident set size in KB.
+*/
+uint64_t peak_rss(void) {
+    struct rusage   rus;
+
+    getrusage(RUSAGE_SELF, &rus);
+
+#if defined (__APPLE__)
+    return rus.ru_maxrss / 1024;
+#else
+    return rus.ru_maxrss;
+#endif
+}
+
+/*
+** Resident set size in KB, the peak if the current size can't be had.
+*/
+uint64_t current_rss(void) {
+    FILE *          fptr;
+    unsigned long   pages;
+    unsigned long   resident;
+
+    fptr = fopen("/proc/self/statm", "rt");
+
+    if (fptr != NULL) {
+        if (fscanf(fptr, "%lu %lu", &pages, &resident) == 2) {
+            fclose(fptr);
+            return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+        }
+
+        fclose(fptr);
+    }
+
+    return peak_rss();
+}
+
+/*
+** Memory that could be had without swapping in KB, the physical
+** memory if the kernel doesn't say.
+*/
+uint64_t available_memory(void) {
+    FILE *          fptr;
+    char            szLine[128];
+    unsigned long   kb;
+
+    fptr = fopen("/proc/meminfo", "rt");
+
+    if (fptr != NULL) {
+        while (fgets(szLine, sizeof(szLine), fptr) != NULL) {
+            if (sscanf(szLine, "MemAvailable: %lu kB", &kb) == 1) {
+                fclose(fptr);
+                return kb;
+            }
+        }
+
+        fclose(fptr);
+    }
+
+    return (uint64_t)sysconf(_SC_PHYS_PAGES) / 1024 * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+/*
+** The modelled work of a phase for a run of terms terms & digits
+** digits, leaving the run being reported on alone. Uses the split of
+** the last progress_init().
+*/
+double progress_estimate(int p, uint64_t terms, uint64_t digits) {
+    double          bits;
+
+    bits = (double)digits * BITS_PER_DIGIT;
+
+    switch (p) {
+        case PROGRESS_SIEVE:
+            return SIEVE_COST * (double)terms * 6.0;
+
+        case PROGRESS_BS:
+            return terms > 0 ? model_bs(terms) : 0.0;
+
+        case PROGRESS_DIV:
+            return DIV_COST * mul_cost(bits);
+
+        case PROGRESS_SQRT:
+            return SQRT_COST * mul_cost(bits);
+
+        case PROGRESS_MUL:
+            return MUL_COST * mul_cost(bits);
+
+        case PROGRESS_OUTPUT:
+            return OUTPUT_COST * mul_cost(bits) * log2(bits + 2.0);
+    }
+
+    return 0.0;
+}
+
+/* the modelled work of one bs() merge over terms terms */
+double progress_merge_estimate(uint64_t terms) {
+    return node_cost(terms);
+}
+
+void progress_init(uint64_t terms, uint64_t digits, double split) {
+    int             i;
+
+    num_terms = terms;
+    split_ratio = split;
+
+    memset(model_cache, 0, sizeof(model_cache));
+
+    total_work = 0.0;
+
+    for (i = 0; i < PROGRESS_DONE; i++) {
+        phase_work[i] = progress_estimate(i, terms, digits);
+        total_work += phase_work[i];
+    }
+
+    start_ms = now_ms();
+    phase_start_ms = start_ms;
+    phase = PROGRESS_SIEVE;
+}
+
+int progress_open_fd(int fd) {
+    /* a listener going away mustn't take the computation with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    report_fd = fd;
+
+    return 0;
+}
+
+int progress_open_socket(const char * pszPath) {
+    struct sockaddr_un  addr;
+    int                 fd;
+
+    if (strlen(pszPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Progress socket path '%s' is too long\n", pszPath);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        fprintf(stderr, "Could not create progress socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, pszPath);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Could not connect to progress socket '%s': %s\n", pszPath, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return progress_open_fd(fd);
+}
+
+/*
+** Work done so far, in model units. Within bs() it is counted as
+** nodes finish, in the phases after it it is estimated from the time
+** spent in the phase at the rate bs() managed.
+*/
+static double work_done(double * rate) {
+    double          done = 0.0;
+    double          in_phase;
+    int64_t         t;
+    int             i;
+
+    *rate = 0.0;
+
+    for (i = 0; i < phase && i < PROGRESS_DONE; i++) {
+        done += phase_work[i];
+    }
+
+    if (phase >= PROGRESS_DONE) {
+        return total_work;
+    }
+
+    t = now_ms();
+
+    if (phase > PROGRESS_BS && bs_ms > 0) {
+        *rate = phase_work[PROGRESS_BS] / ((double)bs_ms / 1000.0);
+    }
+    else if (phase == PROGRESS_BS && t > phase_start_ms) {
+        *rate = (double)__atomic_load_n(&bs_done, __ATOMIC_RELAXED) / ((double)(t - phase_start_ms) / 1000.0);
+    }
+
+    if (phase == PROGRESS_BS) {
+        in_phase = (double)__atomic_load_n(&bs_done, __ATOMIC_RELAXED);
+    }
+    else {
+        in_phase = *rate * (double)(t - phase_start_ms) / 1000.0;
+    }
+
+    /* never claim a phase is finished before it is */
+    if (in_phase > phase_work[phase] * 0.99) {
+        in_phase = phase_work[phase] * 0.99;
+    }
+
+    return done + in_phase;
+}
+
+static void report(void) {
+    char            szLine[512];
+    double          done;
+    double          rate;
+    double          eta;
+    double          phase_percent;
+    double          elapsed;
+    double          bs_secs = 0.0;
+    int64_t         t;
+    uint64_t        leaves;
+    int             len;
+    int             i;
+
+    if (report_fd < 0) {
+        return;
+    }
+
+    t = now_ms();
+    done = work_done(&rate);
+    elapsed = (double)(t - start_ms) / 1000.0;
+    leaves = __atomic_load_n(&bs_leaves, __ATOMIC_RELAXED);
+
+    /* the leaf rate is over bs() alone, not the sieve before it */
+    if (phase == PROGRESS_BS) {
+        bs_secs = (double)(t - bs_start_ms) / 1000.0;
+    }
+    else if (phase > PROGRESS_BS) {
+        bs_secs = (double)bs_ms / 1000.0;
+    }
+
+    phase_percent = 100.0;
+
+    if (phase < PROGRESS_DONE && phase_work[phase] > 0.0) {
+        phase_percent = done;
+
+        for (i = 0; i < phase; i++) {
+            phase_percent -= phase_work[i];
+        }
+
+        phase_percent = 100.0 * max(phase_percent, 0.0) / phase_work[phase];
+    }
+
+    eta = (rate > 0.0) ? (total_work - done) / rate : -1.0;
+
+    len = snprintf(
+            szLine,
+            sizeof(szLine),
+            "{\"phase\":\"%s\",\"phase_percent\":%.2f,\"percent\":%.2f,"
+            "\"elapsed\":%.3f,\"eta\":%.3f,\"terms_done\":%llu,\"terms\":%llu,"
+            "\"terms_per_sec\":%.1f,\"rss_kb\":%llu}\n",
+            phase_names[phase],
+            phase_percent,
+            total_work > 0.0 ? 100.0 * done / total_work : 100.0,
+            elapsed,
+            eta,
+            (unsigned long long)leaves,
+            (unsigned long long)num_terms,
+            bs_secs > 0.0 ? (double)leaves / bs_secs : 0.0,
+            (unsigned long long)current_rss());
+
+    if (write(report_fd, szLine, (size_t)len) != len) {
+        /* the listener has gone, stop reporting */
+        report_fd = -1;
+    }
+}
+
+static void * reporter_thread(void * arg) {
+    struct timespec     ts;
+    int64_t             due;
+
+    pthread_mutex_lock(&lock);
+
+    while (running) {
+        due = now_ms() + interval_ms;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        ts.tv_sec += interval_ms / 1000;
+        ts.tv_nsec += (interval_ms % 1000) * 1000000;
+
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&wakeup, &lock, &ts);
+
+        if (running && now_ms() >= due) {
+            report();
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+/*
+** Start reporting every interval seconds, if a target is open.
+*/
+void progress_start(double interval) {
+    if (report_fd < 0) {
+        return;
+    }
+
+    interval_ms = (int64_t)(interval * 1000.0);
+
+    if (interval_ms < 10) {
+        interval_ms = 10;
+    }
+
+    running = 1;
+
+    if (pthread_create(&reporter, NULL, reporter_thread, NULL) != 0) {
+        running = 0;
+    }
+}
+
+void progress_phase(int p) {
+    int64_t         t;
+
+    pthread_mutex_lock(&lock);
+
+    t = now_ms();
+
+    if (phase == PROGRESS_BS) {
+        bs_ms = t - phase_start_ms;
+    }
+
+    if (p == PROGRESS_BS) {
+        bs_start_ms = t;
+    }
+
+    phase = p;
+    phase_start_ms = t;
+
+    report();
+
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+** A bs() node over terms terms has finished, called from any thread.
+** A dot is printed for every 2% of the modelled bs() work.
+*/
+void progress_bs_node(uint64_t terms) {
+    uint64_t        done;
+    int             expected;
+    int             d;
+
+    if (terms == 1) {
+        __atomic_add_fetch(&bs_leaves, 1, __ATOMIC_RELAXED);
+    }
+
+    if (phase_work[PROGRESS_BS] <= 0.0) {
+        return;
+    }
+
+    done = __atomic_add_fetch(&bs_done, (uint64_t)node_cost(terms), __ATOMIC_RELAXED);
+    d = (int)((double)done * NUM_DOTS / phase_work[PROGRESS_BS]);
+
+    expected = __atomic_load_n(&dots, __ATOMIC_RELAXED);
+
+    while (expected < d && expected < NUM_DOTS) {
+        if (__atomic_compare_exchange_n(&dots, &expected, expected + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            printf(".");
+            fflush(stdout);
+
+            expected++;
+        }
+    }
+}
+
+/*
+** The modelled work of a phase, for the run progress_init() was last
+** called for.
+*/
+double progress_work(int p) {
+    return phase_work[p];
+}
+
+void progress_stop(void) {
+    if (running) {
+        pthread_mutex_lock(&lock);
+        running = 0;
+        pthread_cond_signal(&wakeup);
+        pthread_mutex_unlock(&lock);
+
+        pthread_join(reporter, NULL);
+    }
+
+    if (report_fd >= 0) {
+        pthread_mutex_lock(&lock);
+        phase = PROGRESS_DONE;
+        report();
+        pthread_mutex_unlock(&lock);
+    }
+}
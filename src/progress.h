@@ -0,0 +1,42 @@
+/*
+** Progress reporting.
+**
+** Remaining work is estimated from a cost model of the computation:
+** the bs() tree is walked with the same split as the real thing, each
+** merge costing as much as its multiplies, and the final phases are
+** costed as multiples of a full precision multiply. The rate at which
+** bs() gets through its work calibrates the model for the phases
+** after it.
+**
+** Progress is shown as dots on stdout and, if a target has been
+** opened, reported as newline delimited JSON every interval.
+*/
+#ifndef __INCL_PROGRESS
+#define __INCL_PROGRESS
+
+#include <stdint.h>
+
+#define PROGRESS_SIEVE          0
+#define PROGRESS_BS             1
+#define PROGRESS_DIV            2
+#define PROGRESS_SQRT           3
+#define PROGRESS_MUL            4
+#define PROGRESS_OUTPUT         5
+#define PROGRESS_DONE           6
+
+void        progress_init(uint64_t terms, uint64_t digits, double split);
+int         progress_open_fd(int fd);
+int         progress_open_socket(const char * pszPath);
+void        progress_start(double interval);
+void        progress_phase(int phase);
+void        progress_bs_node(uint64_t terms);
+void        progress_stop(void);
+double      progress_work(int phase);
+double      progress_estimate(int phase, uint64_t terms, uint64_t digits);
+double      progress_merge_estimate(uint64_t terms);
+
+uint64_t    current_rss(void);
+uint64_t    peak_rss(void);
+uint64_t    available_memory(void);
+
+#endif